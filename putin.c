@@ -2,6 +2,11 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 #include <libgen.h>
 #include <math.h>
@@ -9,6 +14,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "miniaudio.h"
 
@@ -19,241 +31,3408 @@
 
 #define ARRLEN(arr) (sizeof(arr)/sizeof(arr[0]))
 #define PATH_LEN 512
-#define TASK_LIST_LEN 512
+#define TASK_PAGE_LEN 64
+#define EVENT_LIST_LEN 64
+#define INPUT_READ_LEN 4096
+#define INPUT_MAX_LEN (64 * 1024)
+#define OUT_CHUNK_LEN 4096
+#define OUT_CHUNK_PREALLOC 32
+#define OUT_IOV_LEN 64
+#define OUT_HIGH_WATER_DEFAULT (1024 * 1024)
+#define COMMAND_TABLE_LEN 64
+#define CROSSFADE_MAX 30.0f // Seconds
+#define CACHE_BUDGET_DEFAULT (256 * 1024 * 1024)
+#define CACHE_GHOSTS 64
+#define MAP_ADVISE_LEN (1024 * 1024)
+#define READAHEAD_BLOCKS 4
+#define READAHEAD_MAX 64 // MiB
+#define JOB_THREADS_DEFAULT 1
+#define PERIOD_MIN 16 // Frames
+#define PERIOD_MAX 16384
+#define DEEP_BUFFER_MAX 10000 // ms
+#define SUSPEND_AFTER_DEFAULT 10.0f // Seconds
+#define SUSPEND_AFTER_MAX 3600.0f
+#define OFFLINE_SAMPLE_RATE 48000
+#define OFFLINE_CHANNELS 2
+#define OFFLINE_PERIOD 480 // Frames
+#define AUDIO_RING_LEN 256 // Power of two, positions wrap around
+#define RENDER_CHUNK 4096 // Frames, committed one by one so playback can start early
+#define RENDER_PROBE 480 // Frames mixed first each round, in case the decoder is behind
+#define RENDER_AHEAD (RENDER_CHUNK * 4) // Track frames a chunk may need, even sped up
+#define RENDER_RETRY_MS 5 // Until the decoder is asked again for the frames it was short of
+#define UNHEARD_MAX 16 // Track changes rendered ahead but not heard yet
+#define MIX_BUCKETS 8 // See mix_bucket_percent
+#define HIST_SUB_BITS 3 // Buckets per power of two as bits, keeps values within 12.5%
+#define HIST_MAX_EXP 40 // Nanoseconds up to 2^40, about 18 minutes
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+#define TRACE_RING_LEN 8192 // Spans kept per thread, older ones are overwritten
+#define TRACE_THREADS 32 // Threads past this many aren't traced
+#define BENCH_STREAMS 4
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_PERIOD_MS 10
+#define BENCH_SPEED 8
 #define SUB(text) "\n\033[90m -- " text "\033[0m\n"
 
+// Only miniaudio.o uses it, the Makefile passes the same value to both
+#ifndef MA_RESOURCE_MANAGER_PAGE_SIZE_IN_MILLISECONDS
+#define MA_RESOURCE_MANAGER_PAGE_SIZE_IN_MILLISECONDS 1000
+#endif
+
 typedef int (*TaskFunc)(int fd);
 
+typedef struct OutChunk OutChunk;
+
+struct OutChunk {
+    OutChunk* next;
+    size_t start;
+    size_t len;
+    char data[OUT_CHUNK_LEN];
+};
+
+// Queue of pending output for a single fd. Chunks come from a shared pool, so
+// once the pool has warmed up formatting responses never allocates
+typedef struct {
+    int fd;
+    OutChunk* head;
+    OutChunk* tail;
+    size_t queued;
+} Output;
+
+// Things `idle` and `subscribe` can wait for
+typedef enum {
+    CHANGE_PLAYER = 1 << 0, // Started, paused, stopped or seeked
+    CHANGE_TRACK  = 1 << 1,
+    CHANGE_VOLUME = 1 << 2,
+    CHANGE_PITCH  = 1 << 3,
+    CHANGE_LOOP   = 1 << 4,
+    CHANGE_QUEUE  = 1 << 5,
+    CHANGE_ALL    = (1 << 6) - 1,
+} Change;
+
+const char* change_names[] = { "player", "track", "volume", "pitch", "loop", "queue" };
+
+#define STATUS_PAGE_MAGIC 0x4e545550 // "PUTN"
+#define STATUS_PAGE_VERSION 1
+
+// Published in putin.status next to the socket for clients to mmap, so they
+// can read the position without talking to the daemon. The writer makes seq
+// odd while it updates the page, so readers retry when seq is odd or has
+// changed while they were copying it. The current position is
+// cursor_frame + (now - timestamp_ns) * sample_rate * pitch / 100 while playing
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    atomic_uint seq;
+    uint32_t playing;
+    uint32_t loop;
+    uint32_t sample_rate;
+    float volume; // Percent
+    float pitch;  // Percent
+    uint64_t cursor_frame;
+    uint64_t length_frames;
+    uint64_t engine_time;  // Engine clock in frames when the cursor was read
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC when the cursor was read
+    char track[PATH_LEN];
+} StatusPage;
+
+typedef struct Task Task;
+
+typedef void (*CommandFunc)(Task* t, char* args);
+
+typedef enum {
+    ARGS_NONE,
+    ARGS_NUMBER_OPT, // Optional number
+    ARGS_STRING,     // Rest of the line, can't be empty
+    ARGS_WORDS,      // Any amount of words
+} ArgSchema;
+
+typedef struct {
+    const char* name;
+    CommandFunc func;
+    ArgSchema args;
+    const char* usage;
+} Command;
+
+// A command run for a task, timed until its response is written out
 typedef struct {
+    uint16_t command; // Index into commands
+    bool done;        // False while the task waits for it, e.g. for a load
+    uint64_t read_ns;
+} TimedCommand;
+
+struct Task {
     int fd;
+    uint32_t events;
     TaskFunc execute_task;
     bool delete;
-} Task;
+    Task* next; // Links free tasks and tasks waiting to be closed
+
+    // Input that has not formed a complete line yet
+    char* in_buf;
+    size_t in_len;
+    size_t in_cap;
+    bool in_eof;
+    uint64_t read_ns; // When input last came in
+
+    // Commands whose response isn't written out yet, see record_answered
+    TimedCommand* timed;
+    size_t timed_len;
+    size_t timed_cap;
+
+    Output out;
+    bool write_blocked; // Waiting for EPOLLOUT instead of running more commands
+    bool waiting;       // Waiting for a command to finish, e.g. for a track to load
+    uint64_t id;        // Tells apart tasks that got the same fd over time
+    bool flush_scheduled;
+    Task* next_flush;
+
+    // Changes the client waits for. idle_mask is cleared after the first
+    // event, sub_mask stays until unsubscribed
+    unsigned idle_mask;
+    unsigned sub_mask;
+    Task* prev_watcher;
+    Task* next_watcher;
+};
+
+typedef struct {
+    uint64_t id; // Stays the same while entries around it come and go
+    char* path;
+    char* name;
+} QueueEntry;
+
+// A sound playing the chain of tracks that starts at `head`, an empty
+// buffer that only holds the chain. A zeroed voice is not initialized,
+// which miniaudio treats as stopped
+typedef struct {
+    ma_sound sound;
+    ma_audio_buffer_ref head;
+    bool live;
+} Voice;
+
+typedef enum {
+    TRACK_START, // Replaces the current track once loaded
+    TRACK_NEXT,  // Gets chained after the current track once loaded
+} TrackRole;
+
+// A track being loaded or played. Loading happens on the resource manager
+// job thread, which signals `loaded` once the decoder is open and the first
+// pages are decoded
+typedef struct Track Track;
+
+struct Track {
+    ma_async_notification_callbacks loaded_cb; // Must be first, miniaudio signals a pointer to it
+    ma_resource_manager_data_source source;
+    ma_data_source_base reader; // Reads `source` for the voice, see read_track
+    atomic_bool loaded;
+    bool cancelled;
+    TrackRole role;
+    uint64_t entry_id;
+    bool decoded; // Decoded into memory up front instead of streamed
+    Voice* voice; // Warmed up before the track plays, see arm_next_track
+    char path[PATH_LEN];
+    Track* next;
 
+    // Client to answer once the track is loaded
+    int reply_fd;
+    uint64_t reply_id;
+};
+
+ma_device output;
 ma_engine audio;
-ma_sound sound;
+ma_resource_manager resources;
+ma_sound_group voice_group; // Mixes the voices, master volume is applied here
+Voice voices[2];
+Voice* voice = &voices[0]; // The one playing current_track
+Track* current_track = NULL;
+Track* loading_tracks = NULL;
+
+QueueEntry* queue = NULL;
+size_t queue_len = 0;
+size_t queue_cap = 0;
+uint64_t last_entry_id = 0;
+
+// Files recently played, most recent first. Pinned entries hold a reference
+// to the resource manager's decoded copy of the file, which keeps it in
+// memory after the track using it is gone. Unpinned ones only remember that
+// the file was played and how large it is decoded, so it gets decoded into
+// memory instead of streamed when it's played again
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+    char path[PATH_LEN];
+    size_t bytes;
+    bool pinned;
+    ma_resource_manager_data_source pin;
+    CacheEntry* prev;
+    CacheEntry* next;
+};
+
+CacheEntry* cache_head = NULL;
+CacheEntry* cache_tail = NULL;
+size_t cache_used = 0; // Bytes held by pinned entries
+size_t cache_ghosts = 0;
+size_t cache_budget = CACHE_BUDGET_DEFAULT;
+uint64_t cache_hits = 0; // Tracks loaded from a decoded copy
+uint64_t cache_misses = 0;
+
+// The loaded track after the current one is handed to the audio thread in
+// one of two ways. If it has the format of the voice's chain, the current
+// track's next callback passes on chained_track, so it starts in the same
+// callback the current one ends in. Otherwise, or when crossfading, it gets
+// its own voice, which the end callback of the current voice starts through
+// armed_voice unless it was scheduled to start earlier.
+// next_track is owned by the event loop, the atomics are what the audio
+// thread may still take
+Track* next_track = NULL;
+bool next_chained = false;
+bool next_armed = false;
+bool crossfading = false; // The next voice is scheduled to fade in
+_Atomic(Track*) chained_track = NULL;
+_Atomic(Voice*) armed_voice = NULL;
 
 char running_filepath[PATH_LEN] = {0};
 bool is_running = true;
 bool loop = false;
 float pitch = 100.0f;
 float volume = 100.0f;
+float crossfade = 0.0f; // Seconds, 0 plays the queue gapless
+ma_uint32 job_threads = JOB_THREADS_DEFAULT;
+ma_uint32 output_period = 0; // Frames, 0 lets the backend choose
+ma_uint32 deep_buffer = 0; // ms, 0 renders in the audio callback
+float suspend_after = SUSPEND_AFTER_DEFAULT; // Seconds, 0 keeps the device running
+bool null_output = false;
+bool offline = false;
+bool sync_load = false;
+char benchmark_path[PATH_LEN] = {0};
+bool metrics = false; // Serves putin-metrics.sock
+size_t out_high_water = OUT_HIGH_WATER_DEFAULT;
+
+// Tasks live in fixed size pages so pointers to them (which epoll holds) stay
+// valid while the table grows. task_by_fd maps fds to their tasks
+Task** task_pages = NULL;
+int task_pages_len = 0;
+Task** task_by_fd = NULL;
+int task_by_fd_len = 0;
+Task* free_tasks = NULL;
+Task* deleted_tasks = NULL;
+int epoll_fd = -1;
+
+OutChunk* free_chunks = NULL;
+Task* flush_list = NULL;
+
+Task* watchers = NULL;
+unsigned pending_changes = 0;
+// Changes noticed on the audio thread, picked up through change_fd
+atomic_bool tracks_loaded = false;
+atomic_bool track_advanced = false;
+atomic_bool chain_ended = false;
+// Callback timing, only written by the audio thread
+_Atomic uint64_t output_callbacks = 0;
+_Atomic uint64_t output_frames = 0;
+_Atomic uint64_t output_gaps = 0;
+_Atomic uint64_t output_gaps_ns = 0;
+_Atomic uint64_t output_last_ns = 0;
+_Atomic uint64_t output_max_gap_ns = 0;
+// Mixing time against how long the mixed frames last, see mix. Written by
+// whoever mixes, the audio callback and the decoder reads it makes
+const unsigned mix_bucket_percent[MIX_BUCKETS - 1] = { 5, 10, 25, 50, 75, 100, 150 };
+_Atomic uint64_t mix_histogram[MIX_BUCKETS];
+_Atomic uint64_t mix_ns = 0;
+_Atomic uint64_t mix_budget_ns = 0;
+_Atomic uint64_t mix_max_ns = 0;
+_Atomic uint64_t mix_overruns = 0; // Took longer than the frames last
+_Atomic uint64_t late_callbacks = 0; // More than two periods after the one before
+_Atomic uint64_t render_underruns = 0; // The deep buffer ran dry
+_Atomic uint64_t starved_reads = 0; // The decoder had nothing ready yet
+_Atomic uint64_t starved_frames = 0;
+_Atomic uint64_t decoded_frames = 0; // Read by the voices, never reset
+
+pthread_t offline_thread;
+pthread_mutex_t offline_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t offline_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t offline_idle = PTHREAD_COND_INITIALIZER;
+bool offline_running = false;
+// Set while a period renders outside offline_lock
+bool offline_busy = false;
+atomic_bool offline_playing = false;
+
+int suspend_fd = -1;
+bool suspend_armed = false;
+bool suspended = false;
+uint64_t suspends = 0;
+_Atomic uint64_t resume_asked_ns = 0; // When the device was started again, until its first callback
+_Atomic uint64_t resume_ns = 0;
+_Atomic uint64_t resume_max_ns = 0;
+
+typedef enum {
+    AUDIO_VOLUME,
+    AUDIO_PITCH,
+    AUDIO_SEEK,
+    AUDIO_RESET_STATS,
+} AudioCommandType;
+
+typedef struct {
+    AudioCommandType type;
+    uint64_t queued_ns;
+    void* target; // Voice for AUDIO_PITCH, Track for AUDIO_SEEK
+    float value;
+    ma_uint64 frame;
+} AudioCommand;
+
+AudioCommand audio_ring[AUDIO_RING_LEN];
+atomic_uint audio_ring_read = 0; // Moved by whoever applies
+atomic_uint audio_ring_write = 0; // Moved by the event loop
+_Atomic uint64_t applied_commands = 0;
+_Atomic uint64_t apply_ns = 0;
+_Atomic uint64_t apply_max_ns = 0;
+Track* seek_track = NULL; // The last queued seek, see track_cursor
+ma_uint64 seek_frame = 0;
+unsigned seek_pos = 0;
+
+pthread_t render_thread;
+pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_work = PTHREAD_COND_INITIALIZER; // Wakes render_thread early
+ma_pcm_rb render_rb;
+ma_uint32 render_frames = 0;
+bool render_running = false;
+bool render_held = false; // The event loop holds render_lock while it changes things
+atomic_bool render_drop = false; // Asks the audio callback to drop render_rb
+atomic_uint render_dropped = 0;
+atomic_bool decoder_behind = false; // A track had less than RENDER_AHEAD frames decoded
+// Frames render_thread wrote and the callback played or dropped. Where a
+// track change or the end was rendered is noted in frames written, so it's
+// reported once it's heard, see hold_change
+_Atomic uint64_t render_written = 0;
+_Atomic uint64_t render_heard = 0;
+uint64_t render_mixing_to = 0; // End of the chunk render_thread is mixing
+_Atomic uint64_t advance_mark = 0;
+_Atomic uint64_t end_mark = 0;
+_Atomic uint64_t next_mark = UINT64_MAX; // The callback wakes the event loop here
+atomic_bool render_caught_up = false;
+int change_fd = -1;
+uint64_t last_task_id = 0;
+// Counted for --metrics
+size_t clients = 0;
+uint64_t bytes_received = 0;
+uint64_t bytes_sent = 0;
+
+StatusPage* status_page = NULL;
+char status_path[PATH_LEN];
+
+OutChunk* get_chunk(void) {
+    OutChunk* c = free_chunks;
+    if (c) {
+        free_chunks = c->next;
+    } else {
+        c = malloc(sizeof(OutChunk));
+        if (!c) return NULL;
+    }
+    c->next = NULL;
+    c->start = 0;
+    c->len = 0;
+    return c;
+}
+
+void put_chunk(OutChunk* c) {
+    c->next = free_chunks;
+    free_chunks = c;
+}
+
+bool prealloc_chunks(int count) {
+    for (int i = 0; i < count; i++) {
+        OutChunk* c = malloc(sizeof(OutChunk));
+        if (!c) return false;
+        put_chunk(c);
+    }
+    return true;
+}
+
+void clear_output(Output* out) {
+    while (out->head) {
+        OutChunk* c = out->head;
+        out->head = c->next;
+        put_chunk(c);
+    }
+    out->tail = NULL;
+    out->queued = 0;
+}
+
+// Returns the chunk new data should be appended to, adding a fresh one if
+// the last chunk has less than `need` bytes left
+OutChunk* output_tail(Output* out, size_t need) {
+    if (out->tail && OUT_CHUNK_LEN - out->tail->start - out->tail->len >= need) return out->tail;
+
+    OutChunk* c = get_chunk();
+    if (!c) return NULL;
+    if (out->tail) {
+        out->tail->next = c;
+    } else {
+        out->head = c;
+    }
+    out->tail = c;
+    return c;
+}
+
+void out_write(Output* out, const char* data, size_t len) {
+    while (len > 0) {
+        OutChunk* c = output_tail(out, 1);
+        if (!c) return;
+
+        size_t space = OUT_CHUNK_LEN - c->start - c->len;
+        size_t n = len < space ? len : space;
+        memcpy(c->data + c->start + c->len, data, n);
+        c->len += n;
+        out->queued += n;
+        data += n;
+        len -= n;
+    }
+}
+
+__attribute__((format(printf, 2, 3)))
+void out_printf(Output* out, const char* fmt, ...) {
+    va_list args;
+
+    OutChunk* c = output_tail(out, 1);
+    if (!c) return;
+    size_t space = OUT_CHUNK_LEN - c->start - c->len;
+
+    va_start(args, fmt);
+    int len = vsnprintf(c->data + c->start + c->len, space, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+
+    if ((size_t)len < space) {
+        c->len += len;
+        out->queued += len;
+        return;
+    }
+
+    // Didn't fit. Format again into a fresh chunk, or into a temporary
+    // buffer if the text is larger than a whole chunk
+    if (len < OUT_CHUNK_LEN) {
+        c = output_tail(out, len + 1);
+        if (!c) return;
+        va_start(args, fmt);
+        vsnprintf(c->data + c->start + c->len, len + 1, fmt, args);
+        va_end(args);
+        c->len += len;
+        out->queued += len;
+        return;
+    }
+
+    char* tmp = malloc(len + 1);
+    if (!tmp) return;
+    va_start(args, fmt);
+    vsnprintf(tmp, len + 1, fmt, args);
+    va_end(args);
+    out_write(out, tmp, len);
+    free(tmp);
+}
+
+// Writes as much queued output as the fd accepts with one writev per
+// OUT_IOV_LEN chunks. Returns 1 when everything was written, 0 if the fd
+// would block and -1 on error
+int flush_output(Output* out) {
+    while (out->head) {
+        struct iovec iov[OUT_IOV_LEN];
+        int iov_len = 0;
+        for (OutChunk* c = out->head; c && iov_len < OUT_IOV_LEN; c = c->next) {
+            iov[iov_len++] = (struct iovec) {
+                .iov_base = c->data + c->start,
+                .iov_len = c->len,
+            };
+        }
+
+        ssize_t written = writev(out->fd, iov, iov_len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        out->queued -= written;
+        bytes_sent += written;
+        while (written > 0) {
+            OutChunk* c = out->head;
+            if ((size_t)written < c->len) {
+                c->start += written;
+                c->len -= written;
+                break;
+            }
+            written -= c->len;
+            out->head = c->next;
+            put_chunk(c);
+        }
+        if (!out->head) out->tail = NULL;
+    }
+
+    return 1;
+}
+
+bool grow_task_table(int fd) {
+    if (fd >= task_by_fd_len) {
+        int new_len = task_by_fd_len ? task_by_fd_len : TASK_PAGE_LEN;
+        while (new_len <= fd) new_len *= 2;
+
+        Task** new_by_fd = realloc(task_by_fd, new_len * sizeof(Task*));
+        if (!new_by_fd) return false;
+        memset(new_by_fd + task_by_fd_len, 0, (new_len - task_by_fd_len) * sizeof(Task*));
+        task_by_fd = new_by_fd;
+        task_by_fd_len = new_len;
+    }
+
+    if (free_tasks) return true;
+
+    Task** new_pages = realloc(task_pages, (task_pages_len + 1) * sizeof(Task*));
+    if (!new_pages) return false;
+    task_pages = new_pages;
+
+    Task* page = calloc(TASK_PAGE_LEN, sizeof(Task));
+    if (!page) return false;
+    task_pages[task_pages_len++] = page;
+
+    for (int i = TASK_PAGE_LEN - 1; i >= 0; i--) {
+        page[i].next = free_tasks;
+        free_tasks = &page[i];
+    }
+    return true;
+}
 
-Task task_list[TASK_LIST_LEN];
-int task_list_len = 0;
+// Tasks registered with EPOLLET must keep returning 0 from execute_task until
+// they hit EAGAIN, otherwise the remaining data will never be reported again
+bool new_task(int fd, uint32_t events, TaskFunc task_func) {
+    if (!grow_task_table(fd)) {
+        printf("Can't create new task: Out of memory\n" SUB("Download more RAM"));
+        return false;
+    }
 
-bool new_task(int fd, TaskFunc task_func) {
-    if (task_list_len >= TASK_LIST_LEN) {
-        printf("Can't create new task: Max task limit reached\n" SUB("WTF"));
+    Task* t = free_tasks;
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = t,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        // Regular files and /dev/null can't be polled, which is up to the caller to mention
+        if (errno != EPERM) printf("Can't create new task: %s\n" SUB("Epoll said no"), strerror(errno));
         return false;
     }
-    task_list[task_list_len++] = (Task) {
+
+    free_tasks = t->next;
+    *t = (Task) {
         .fd = fd,
+        .events = events,
         .execute_task = task_func,
         .delete = false,
+        .next = NULL,
+        .out = { .fd = fd },
+        .id = ++last_task_id,
     };
+    task_by_fd[fd] = t;
     return true;
 }
 
 Task* get_task(int fd) {
-    for (int i = 0; i < task_list_len; i++) {
-        if (task_list[i].fd != fd) continue;
-        return &task_list[i];
-    }
-    return NULL;
+    if (fd < 0 || fd >= task_by_fd_len) return NULL;
+    return task_by_fd[fd];
 }
 
+// The fd is only closed in reap_tasks, so it can't be reused by a new task
+// while events for the old one are still being dispatched
+void unwatch(Task* t);
+
 void delete_task(int fd) {
     Task* t = get_task(fd);
-    if (!t) return;
+    if (!t || t->delete) return;
     t->delete = true;
+    unwatch(t);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    t->next = deleted_tasks;
+    deleted_tasks = t;
 }
 
-char* cut_and_get_next_word(char* inp) {
-    if (!*inp) return inp;
-    while (*inp != ' ' && *inp != '\n' && *inp != '\0') inp++;
-    if (*inp == '\0') return inp;
-    *inp = '\0';
-    inp++;
+int serve_client(int client);
 
-    while (*inp == ' ' || *inp == '\n') inp++;
-    return inp;
+void reap_tasks(void) {
+    while (deleted_tasks) {
+        Task* t = deleted_tasks;
+        deleted_tasks = t->next;
+
+        if (t->execute_task == serve_client) clients--;
+        close(t->fd);
+        free(t->in_buf);
+        free(t->timed);
+        clear_output(&t->out);
+        task_by_fd[t->fd] = NULL;
+        t->next = free_tasks;
+        free_tasks = t;
+    }
+}
+
+void free_task_table(void) {
+    for (int i = 0; i < task_by_fd_len; i++) {
+        if (!task_by_fd[i]) continue;
+        close(i);
+        free(task_by_fd[i]->in_buf);
+        free(task_by_fd[i]->timed);
+        clear_output(&task_by_fd[i]->out);
+    }
+    for (int i = 0; i < task_pages_len; i++) free(task_pages[i]);
+    free(task_pages);
+    free(task_by_fd);
+    task_pages = NULL;
+    task_pages_len = 0;
+    task_by_fd = NULL;
+    task_by_fd_len = 0;
+    free_tasks = NULL;
+    deleted_tasks = NULL;
+    flush_list = NULL;
+
+    while (free_chunks) {
+        OutChunk* c = free_chunks;
+        free_chunks = c->next;
+        free(c);
+    }
+}
+
+void watch(Task* t) {
+    if (t->prev_watcher || watchers == t) return;
+    t->next_watcher = watchers;
+    if (watchers) watchers->prev_watcher = t;
+    watchers = t;
+}
+
+void unwatch(Task* t) {
+    if (!t->prev_watcher && watchers != t) return;
+    if (t->prev_watcher) {
+        t->prev_watcher->next_watcher = t->next_watcher;
+    } else {
+        watchers = t->next_watcher;
+    }
+    if (t->next_watcher) t->next_watcher->prev_watcher = t->prev_watcher;
+    t->prev_watcher = NULL;
+    t->next_watcher = NULL;
+}
+
+void notify(unsigned changes) {
+    pending_changes |= changes;
+}
+
+// With --deep-buffer, track changes and the end are rendered up to the
+// buffer length before they're heard. Until then they wait here, with the
+// track that's still heard before them
+typedef struct {
+    uint64_t mark; // render_written where the change was rendered
+    unsigned changes;
+    char name[PATH_LEN];
+    ma_uint64 length;
+    ma_uint32 sample_rate;
+} UnheardChange;
+
+UnheardChange unheard[UNHEARD_MAX];
+size_t unheard_head = 0;
+size_t unheard_len = 0;
+
+// Tells the clients about the changes that were heard, up to `heard` frames
+void hear_changes(uint64_t heard) {
+    while (unheard_len > 0) {
+        UnheardChange* c = &unheard[unheard_head];
+        if (c->mark > heard) break;
+        notify(c->changes);
+        unheard_head = (unheard_head + 1) % UNHEARD_MAX;
+        unheard_len--;
+    }
+    atomic_store(&next_mark, unheard_len > 0 ? unheard[unheard_head].mark : UINT64_MAX);
 }
 
-void print_time(float t, FILE* f) {
-    fprintf(f, "%02d:%02d", (int)fmodf(t / 60.0f, 60.0f), (int)fmodf(t, 60.0f));
+// Called once the callback played up to next_mark. It may have played past
+// the following mark before it was set, so that's checked again
+void catch_up_render(void) {
+    uint64_t heard;
+    do {
+        heard = atomic_load(&render_heard);
+        hear_changes(heard);
+    } while (atomic_load(&next_mark) <= heard);
 }
 
-void print_status(FILE* f) {
-    if (!ma_sound_is_playing(&sound)) {
-        fprintf(f, "stopped\n");
+// Tells the clients about a track change or the end once it's heard. The
+// track that plays up to it is the current one
+void hold_change(unsigned changes, uint64_t mark) {
+    if (!render_running || mark <= atomic_load(&render_heard)) {
+        notify(changes);
         return;
     }
+    if (unheard_len == UNHEARD_MAX) hear_changes(unheard[unheard_head].mark);
+
+    UnheardChange* c = &unheard[(unheard_head + unheard_len) % UNHEARD_MAX];
+    c->mark = mark;
+    c->changes = changes;
+    memcpy(c->name, running_filepath, PATH_LEN);
+    c->length = 0;
+    c->sample_rate = 0;
+    if (current_track) {
+        ma_data_source_get_length_in_pcm_frames(&current_track->source, &c->length);
+        ma_data_source_get_data_format(&current_track->source, NULL, NULL, &c->sample_rate, NULL, 0);
+    }
+    unheard_len++;
+    catch_up_render();
+}
+
+void wake_event_loop(void) {
+    uint64_t one = 1;
+    if (write(change_fd, &one, sizeof(one)) == -1) return;
+}
+
+// In deep buffer mode the audio callbacks run on render_thread, in the
+// middle of a chunk
+void mark_render(_Atomic uint64_t* mark) {
+    if (render_running) atomic_store(mark, render_mixing_to);
+}
+
+// Called on the audio thread, so apart from starting an armed voice it only
+// passes the change on to the event loop
+void on_sound_end(void* user_data, ma_sound* s) {
+    (void) user_data;
+    (void) s;
+    Voice* next = atomic_exchange(&armed_voice, NULL);
+    if (next) {
+        // Drops a crossfade start that was estimated too late
+        ma_sound_set_start_time_in_pcm_frames(&next->sound, 0);
+        ma_sound_start(&next->sound);
+        mark_render(&advance_mark);
+        atomic_store(&track_advanced, true);
+    } else {
+        mark_render(&end_mark);
+        atomic_store(&chain_ended, true);
+    }
+    wake_event_loop();
+}
+
+void finish_loaded_tracks(void);
+void advance_track(void);
+void end_chain(void);
+
+int serve_changes(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+        printf("Cannot read eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (atomic_exchange(&track_advanced, false)) advance_track();
+    if (atomic_exchange(&tracks_loaded, false)) finish_loaded_tracks();
+    if (atomic_exchange(&chain_ended, false)) {
+        hold_change(CHANGE_PLAYER, atomic_load(&end_mark));
+        end_chain();
+    }
+    if (atomic_exchange(&render_caught_up, false)) catch_up_render();
+    return 1;
+}
+
+void schedule_flush(Task* t);
+
+// Sends every watcher a single line with the changes it waits for. Only
+// clients waiting for something are visited, and only when something changed
+void push_changes(void) {
+    if (!pending_changes) return;
 
-    fprintf(f, "[");
+    Task* next;
+    for (Task* t = watchers; t; t = next) {
+        next = t->next_watcher;
 
-    float t = 0.0f;
-    ma_sound_get_cursor_in_seconds(&sound, &t);
-    print_time(t, f);
+        unsigned changes = pending_changes & (t->idle_mask | t->sub_mask);
+        if (!changes) continue;
 
-    fprintf(f, "/");
+        out_printf(&t->out, "changed");
+        for (size_t i = 0; i < ARRLEN(change_names); i++) {
+            if (changes & (1 << i)) out_printf(&t->out, " %s", change_names[i]);
+        }
+        out_printf(&t->out, "\n");
+        schedule_flush(t);
 
-    ma_sound_get_length_in_seconds(&sound, &t);
-    print_time(t, f);
+        t->idle_mask = 0;
+        if (!t->sub_mask) unwatch(t);
+    }
 
-    fprintf(f, "] - %s", *running_filepath != '\0' ? running_filepath : "unnamed");
-    if (ma_sound_is_looping(&sound)) fprintf(f, " loop");
-    fprintf(f, "\n");
+    pending_changes = 0;
 }
 
-void process_commands(char* command, FILE* f) {
-    char* args = cut_and_get_next_word(command);
+uint64_t now_ns(void);
 
-    if (!strcmp(command, "status")) {
-        print_status(f);
-        return;
-    } else if (!strcmp(command, "time")) {
-        float cur = 0.0f, len = 0.0f;
-        ma_sound_get_cursor_in_seconds(&sound, &cur);
-        ma_sound_get_length_in_seconds(&sound, &len);
-        fprintf(f, "%.3f\n%.3f\n", cur, len);
-        return;
-    } else if (!strcmp(command, "seek")) {
-        if (!ma_sound_is_playing(&sound)) ma_sound_start(&sound);
+// `trace start` records spans of work on every thread into a ring per
+// thread, which `trace stop` writes out as a Chrome trace. Recording takes
+// no lock, and while nothing is traced a span costs one atomic load
+
+typedef struct {
+    const char* cat;
+    const char* name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+} TraceEvent;
+
+typedef struct {
+    const char* thread;
+    atomic_bool writing; // Waited for by stop_trace
+    _Atomic uint64_t written; // The last TRACE_RING_LEN are kept
+    TraceEvent events[TRACE_RING_LEN];
+} TraceRing;
+
+TraceRing trace_rings[TRACE_THREADS];
+atomic_uint trace_threads = 0; // Rings handed out, for good
+atomic_bool tracing = false;
+_Atomic uint64_t trace_start_ns = 0;
+_Thread_local TraceRing* trace_ring = NULL;
+_Thread_local bool trace_untraced = false; // Came after all rings were taken
+_Thread_local const char* trace_thread_name = NULL; // Falls back to the first span's category
+
+bool claim_trace_ring(const char* cat) {
+    if (trace_untraced) return false;
+    unsigned i = atomic_fetch_add(&trace_threads, 1);
+    if (i >= TRACE_THREADS) {
+        trace_untraced = true;
+        return false;
+    }
+    trace_ring = &trace_rings[i];
+    trace_ring->thread = trace_thread_name ? trace_thread_name : cat;
+    return true;
+}
+
+void trace_span(const char* cat, const char* name, uint64_t start, uint64_t end) {
+    // Acquire, so trace_start_ns is the one stored before tracing started
+    if (!atomic_load_explicit(&tracing, memory_order_acquire)) return;
+    if (start < atomic_load_explicit(&trace_start_ns, memory_order_relaxed)) return;
+    if (!trace_ring && !claim_trace_ring(cat)) return;
+
+    // stop_trace clears tracing, then waits for writing. One of the two
+    // always sees the other
+    TraceRing* r = trace_ring;
+    atomic_store(&r->writing, true);
+    if (atomic_load(&tracing)) {
+        uint64_t n = atomic_load_explicit(&r->written, memory_order_relaxed);
+        r->events[n % TRACE_RING_LEN] = (TraceEvent) {
+            .cat = cat,
+            .name = name,
+            .start_ns = start,
+            .dur_ns = end - start,
+        };
+        atomic_store_explicit(&r->written, n + 1, memory_order_release);
+    }
+    atomic_store_explicit(&r->writing, false, memory_order_release);
+}
+
+// Start of a span, 0 while not tracing
+uint64_t trace_begin(void) {
+    return atomic_load_explicit(&tracing, memory_order_relaxed) ? now_ns() : 0;
+}
+
+void trace_end(const char* cat, const char* name, uint64_t start) {
+    if (start) trace_span(cat, name, start, now_ns());
+}
+
+// Volume, pitch and seeks are queued in audio_ring and applied by the
+// thread that mixes, right before it mixes a period. So they land on
+// period boundaries and the audio thread never waits for a lock. While
+// nothing mixes, the event loop applies them itself, see sync_commands.
+// Streams are the exception, see queue_seek
 
-        float pos = atof(args);
-        float len = 0.0f;
-        ma_sound_get_length_in_seconds(&sound, &len);
-        if (pos < 0.0f || pos > len) {
-            fprintf(f, "invalid time\n");
+bool output_stopped(void);
+
+// Called by whoever mixes, so nothing is counted twice
+void reset_stats(void) {
+    for (size_t i = 0; i < MIX_BUCKETS; i++) atomic_store_explicit(&mix_histogram[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&mix_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&mix_budget_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&mix_max_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&mix_overruns, 0, memory_order_relaxed);
+    atomic_store_explicit(&late_callbacks, 0, memory_order_relaxed);
+    atomic_store_explicit(&render_underruns, 0, memory_order_relaxed);
+    atomic_store_explicit(&starved_reads, 0, memory_order_relaxed);
+    atomic_store_explicit(&starved_frames, 0, memory_order_relaxed);
+}
+
+// Called by whoever mixes, before every period
+void apply_audio_commands(void) {
+    unsigned read = atomic_load_explicit(&audio_ring_read, memory_order_relaxed);
+    unsigned write = atomic_load_explicit(&audio_ring_write, memory_order_acquire);
+    if (read == write) return;
+
+    uint64_t now = now_ns();
+    atomic_fetch_add_explicit(&applied_commands, write - read, memory_order_relaxed);
+    for (; read != write; read++) {
+        AudioCommand* c = &audio_ring[read % AUDIO_RING_LEN];
+        switch (c->type) {
+        case AUDIO_VOLUME:
+            ma_sound_group_set_volume(&voice_group, c->value);
+            break;
+        case AUDIO_PITCH:
+            ma_sound_set_pitch(&((Voice*)c->target)->sound, c->value);
+            break;
+        case AUDIO_SEEK:
+            ma_data_source_seek_to_pcm_frame(&((Track*)c->target)->source, c->frame);
+            break;
+        case AUDIO_RESET_STATS:
+            reset_stats();
+            break;
+        }
+        uint64_t took = now - c->queued_ns;
+        atomic_fetch_add_explicit(&apply_ns, took, memory_order_relaxed);
+        if (took > atomic_load_explicit(&apply_max_ns, memory_order_relaxed)) {
+            atomic_store_explicit(&apply_max_ns, took, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&audio_ring_read, read, memory_order_release);
+}
+
+// Returns once everything queued is applied. Before a voice or track goes
+// away, nothing queued may point at it anymore
+void sync_commands(void) {
+    while (atomic_load(&audio_ring_read) != atomic_load(&audio_ring_write)) {
+        if (render_running) {
+            // render_thread only mixes with render_lock held
+            if (!render_held) pthread_mutex_lock(&render_lock);
+            apply_audio_commands();
+            if (!render_held) pthread_mutex_unlock(&render_lock);
             return;
         }
-        ma_sound_seek_to_second(&sound, pos);
-        print_status(f);
-        return;
-    } else if (!strcmp(command, "loop")) {
-        loop = !ma_sound_is_looping(&sound);
-        ma_sound_set_looping(&sound, loop);
-        fprintf(f, "loop %s\n", loop ? "on" : "off");
-        return;
-    } else if (!strcmp(command, "play")) {
-        if (args[0] == '\0') {
-            fprintf(f, "usage: play <music_file_path>\n");
+        if (output_stopped()) {
+            apply_audio_commands();
             return;
         }
+        usleep(100);
+    }
+}
+
+// Returns the ring position of the command
+unsigned queue_audio_command(AudioCommand c) {
+    _Static_assert((AUDIO_RING_LEN & (AUDIO_RING_LEN - 1)) == 0, "Ring positions must wrap at a multiple of its length");
+    unsigned write = atomic_load_explicit(&audio_ring_write, memory_order_relaxed);
+    if (write - atomic_load_explicit(&audio_ring_read, memory_order_acquire) == AUDIO_RING_LEN) sync_commands();
+    c.queued_ns = now_ns();
+    audio_ring[write % AUDIO_RING_LEN] = c;
+    atomic_store_explicit(&audio_ring_write, write + 1, memory_order_release);
+    return write;
+}
+
+// A stream seeks by posting a job to the resource manager, which takes a
+// lock and can fail, so streams seek right away on the event loop. Their
+// reads see the seek as a whole, they're busy until it's done
+bool queue_seek(Track* track, ma_uint64 frame) {
+    if (!track->decoded) return ma_data_source_seek_to_pcm_frame(&track->source, frame) == MA_SUCCESS;
+    seek_pos = queue_audio_command((AudioCommand) { .type = AUDIO_SEEK, .target = track, .frame = frame });
+    seek_track = track;
+    seek_frame = frame;
+    return true;
+}
+
+// Cursor of a track, counting a seek that's queued but not applied yet
+ma_uint64 track_cursor(Track* track) {
+    if (track == seek_track && (int)(atomic_load(&audio_ring_read) - seek_pos) <= 0) return seek_frame;
+    ma_uint64 cursor = 0;
+    ma_data_source_get_cursor_in_pcm_frames(&track->source, &cursor);
+    return cursor;
+}
+
+// Mixes a period and sorts the time it took into mix_histogram, by how
+// much of the time the frames last it used up
+void mix(void* out, ma_uint32 frames) {
+    uint64_t start = now_ns();
+    apply_audio_commands();
+    ma_engine_read_pcm_frames(&audio, out, frames, NULL);
+    uint64_t end = now_ns();
+    trace_span("audio", "mix", start, end);
+    uint64_t took = end - start;
+
+    uint64_t budget = (uint64_t)frames * 1000000000 / ma_engine_get_sample_rate(&audio);
+    size_t bucket = 0;
+    while (bucket < MIX_BUCKETS - 1 && took * 100 >= budget * mix_bucket_percent[bucket]) bucket++;
+    atomic_fetch_add_explicit(&mix_histogram[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mix_ns, took, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mix_budget_ns, budget, memory_order_relaxed);
+    if (took > atomic_load_explicit(&mix_max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&mix_max_ns, took, memory_order_relaxed);
+    }
+    if (took > budget) atomic_fetch_add_explicit(&mix_overruns, 1, memory_order_relaxed);
+}
+
+// miniaudio calls the end callback while the sound is still started and
+// stops it a period later, so the round woken by the end still has to
+// count an ended sound as stopped
+bool is_playing(void) {
+    if (!current_track) return false;
+    // The end is rendered, but still in render_rb
+    if (unheard_len > 0) return true;
+    return ma_sound_is_playing(&voice->sound) && !ma_sound_at_end(&voice->sound);
+}
+
+// With --deep-buffer, render_thread mixes seconds of audio at once into
+// render_rb and the audio callback only copies from it, so the mixing and
+// decoding wake up rarely. Whatever changes what's heard flushes the buffer
+// first, see flush_render
+
+// Track frames that the engine frames stand for at the current pitch
+ma_uint64 to_track_frames(ma_uint64 engine_frames, ma_uint32 sample_rate) {
+    return (double)engine_frames * sample_rate / ma_engine_get_sample_rate(&audio) * (pitch / 100.0f);
+}
+
+// Moves a cursor of the playing track back by what's rendered but not heard
+ma_uint64 heard_cursor(ma_uint64 cursor, ma_uint32 sample_rate) {
+    if (!render_running || !is_playing()) return cursor;
+    ma_uint64 ahead = to_track_frames(ma_pcm_rb_available_read(&render_rb), sample_rate);
+    return cursor > ahead ? cursor - ahead : 0;
+}
+
+// Waits with render_lock held until woken early or `ns` have passed
+void wait_render(uint64_t ns) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ns += deadline.tv_nsec;
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&render_work, &render_lock, &deadline);
+}
+
+void* run_render_thread(void* arg) {
+    (void) arg;
+    trace_thread_name = "render";
+    ma_uint32 rate = ma_engine_get_sample_rate(&audio);
+    bool behind = false; // The last round stopped early for the decoder
+    pthread_mutex_lock(&render_lock);
+    while (render_running) {
+        ma_uint32 space = ma_pcm_rb_available_write(&render_rb);
+        if (space < render_frames / 2 && !behind && output_stopped()) {
+            // Nothing plays the buffer, woken up once something does
+            pthread_cond_wait(&render_work, &render_lock);
+            continue;
+        }
+        if (space < render_frames / 2 && !behind) {
+            // Back once half of the buffer has played
+            wait_render((uint64_t)(render_frames / 2 - space) * 1000000000 / rate);
+            continue;
+        }
+
+        // Streamed tracks only have a couple of pages decoded at a time, so
+        // the round stops where the next chunk could run past them and
+        // carries on once the decoder had a moment to refill them. It starts
+        // with a short chunk, as a seek or a new track may not be decoded yet
+        behind = false;
+        ma_uint32 chunk = RENDER_PROBE;
+        while (space > 0) {
+            ma_uint32 frames = space < chunk ? space : chunk;
+            void* buf;
+            if (ma_pcm_rb_acquire_write(&render_rb, &frames, &buf) != MA_SUCCESS || frames == 0) break;
+            atomic_store(&decoder_behind, false);
+            render_mixing_to = atomic_load(&render_written) + frames;
+            mix(buf, frames);
+            ma_pcm_rb_commit_write(&render_rb, frames);
+            atomic_store(&render_written, render_mixing_to);
+            space -= frames;
+            if (atomic_load(&decoder_behind)) {
+                behind = true;
+                wait_render((uint64_t)RENDER_RETRY_MS * 1000000);
+                break;
+            }
+            chunk = RENDER_CHUNK;
+        }
+    }
+    pthread_mutex_unlock(&render_lock);
+    return NULL;
+}
+
+// Counts frames of render_rb as heard, and wakes the event loop once the
+// next rendered change is
+void hear_rendered(ma_uint64 frames) {
+    uint64_t heard = atomic_fetch_add(&render_heard, frames) + frames;
+    uint64_t mark = atomic_load(&next_mark);
+    if (heard >= mark && heard - frames < mark) {
+        atomic_store(&render_caught_up, true);
+        wake_event_loop();
+    }
+}
+
+// Called on the audio thread. Plays a period of what render_thread left,
+// then drops the rest if the event loop asked for it
+void play_rendered(float* out, ma_uint32 frames) {
+    ma_uint32 channels = ma_pcm_rb_get_channels(&render_rb);
+    while (frames > 0) {
+        ma_uint32 n = frames;
+        void* buf;
+        if (ma_pcm_rb_acquire_read(&render_rb, &n, &buf) != MA_SUCCESS || n == 0) break;
+        memcpy(out, buf, n * channels * sizeof(float));
+        ma_pcm_rb_commit_read(&render_rb, n);
+        hear_rendered(n);
+        out += n * channels;
+        frames -= n;
+    }
+    // Ran dry, render_thread is late
+    memset(out, 0, frames * channels * sizeof(float));
+    if (frames > 0) atomic_fetch_add_explicit(&render_underruns, 1, memory_order_relaxed);
+
+    if (atomic_load(&render_drop)) {
+        ma_uint32 n = ma_pcm_rb_available_read(&render_rb);
+        ma_pcm_rb_seek_read(&render_rb, n);
+        hear_rendered(n);
+        atomic_store(&render_dropped, n);
+        atomic_store(&render_drop, false);
+    }
+}
+
+void schedule_crossfade(void);
+
+// Throws away what's rendered ahead, so a change is heard right away
+// instead of after the buffer, and rewinds the track to where playback
+// really is. Track changes and ends already rendered aren't undone.
+// render_thread stays held off until the event loop is done with the
+// change, see release_render
+void flush_render(void) {
+    if (!render_running || render_held) return;
+    pthread_mutex_lock(&render_lock);
+    render_held = true;
+
+    // The callback drops it after playing its next period. A stopped
+    // device runs no callback, so then it's dropped right here
+    atomic_store(&render_drop, true);
+    while (atomic_load(&render_drop)) {
+        if (output_stopped()) {
+            ma_uint32 n = ma_pcm_rb_available_read(&render_rb);
+            ma_pcm_rb_seek_read(&render_rb, n);
+            hear_rendered(n);
+            atomic_store(&render_dropped, n);
+            atomic_store(&render_drop, false);
+            break;
+        }
+        usleep(500);
+    }
+
+    sync_commands();
+    // Dropped, the rendered changes count as heard
+    catch_up_render();
+    ma_uint64 back = atomic_load(&render_dropped);
+    if (!current_track || !back || !is_playing()) return;
+
+    ma_uint64 cursor = track_cursor(current_track), length = 0;
+    ma_uint32 sample_rate = 0;
+    ma_data_source_get_length_in_pcm_frames(&current_track->source, &length);
+    ma_data_source_get_data_format(&current_track->source, NULL, NULL, &sample_rate, NULL, 0);
+    back = to_track_frames(back, sample_rate);
+    if (back <= cursor) {
+        cursor -= back;
+    } else if (loop && length) {
+        cursor = (length - (back - cursor) % length) % length;
+    } else {
+        cursor = 0;
+    }
+    ma_data_source_seek_to_pcm_frame(&current_track->source, cursor);
+    schedule_crossfade();
+}
 
-        ma_sound_uninit(&sound);
-        *running_filepath = '\0';
+// Called once per event loop round, after the commands
+void release_render(void) {
+    if (!render_held) return;
+    render_held = false;
+    pthread_cond_signal(&render_work);
+    pthread_mutex_unlock(&render_lock);
+}
+
+void wake_render(void) {
+    if (!render_running) return;
+    pthread_mutex_lock(&render_lock);
+    pthread_cond_signal(&render_work);
+    pthread_mutex_unlock(&render_lock);
+}
+
+bool start_render_thread(void) {
+    render_frames = (ma_uint64)deep_buffer * ma_engine_get_sample_rate(&audio) / 1000;
+    if (ma_pcm_rb_init(ma_format_f32, ma_engine_get_channels(&audio), render_frames, NULL, NULL, &render_rb) != MA_SUCCESS) {
+        return false;
+    }
+    render_running = true;
+    if (pthread_create(&render_thread, NULL, run_render_thread, NULL) != 0) {
+        render_running = false;
+        ma_pcm_rb_uninit(&render_rb);
+        return false;
+    }
+    return true;
+}
+
+// Before the tracks are freed, render_thread plays them
+void stop_render_thread(void) {
+    if (!render_running) return;
+    release_render();
+    pthread_mutex_lock(&render_lock);
+    render_running = false;
+    pthread_cond_signal(&render_work);
+    pthread_mutex_unlock(&render_lock);
+    pthread_join(render_thread, NULL);
+}
+
+// Name, cursor and length in frames of the track the listener hears. That's
+// the current track, unless a change to it or its end isn't heard yet.
+// The voice only knows about its head
+const char* get_heard_track(ma_uint64* cursor, ma_uint64* length, ma_uint32* sample_rate) {
+    *cursor = 0;
+    *length = 0;
+    *sample_rate = 0;
+    if (unheard_len > 0) {
+        UnheardChange* c = &unheard[unheard_head];
+        uint64_t heard = atomic_load(&render_heard);
+        ma_uint64 left = to_track_frames(c->mark > heard ? c->mark - heard : 0, c->sample_rate);
+        *cursor = left < c->length ? c->length - left : 0;
+        *length = c->length;
+        *sample_rate = c->sample_rate;
+        return c->name;
+    }
+    if (current_track) {
+        ma_data_source_get_length_in_pcm_frames(&current_track->source, length);
+        ma_data_source_get_data_format(&current_track->source, NULL, NULL, sample_rate, NULL, 0);
+        *cursor = heard_cursor(track_cursor(current_track), *sample_rate);
+    }
+    return running_filepath;
+}
+
+void get_track_time(float* cur, float* len) {
+    ma_uint64 cursor, length;
+    ma_uint32 sample_rate;
+    get_heard_track(&cursor, &length, &sample_rate);
+    if (!sample_rate) return;
+    *cur = (float)cursor / sample_rate;
+    *len = (float)length / sample_rate;
+}
+
+void publish_status(void) {
+    if (!status_page) return;
+
+    ma_uint64 cursor, length;
+    ma_uint32 sample_rate;
+    const char* name = get_heard_track(&cursor, &length, &sample_rate);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    unsigned seq = atomic_load_explicit(&status_page->seq, memory_order_relaxed);
+    atomic_store_explicit(&status_page->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    status_page->playing = is_playing();
+    status_page->loop = loop;
+    status_page->sample_rate = sample_rate;
+    status_page->volume = volume;
+    status_page->pitch = pitch;
+    status_page->cursor_frame = cursor;
+    status_page->length_frames = length;
+    status_page->engine_time = ma_engine_get_time_in_pcm_frames(&audio);
+    status_page->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    snprintf(status_page->track, sizeof(status_page->track), "%s", name);
+
+    atomic_store_explicit(&status_page->seq, seq + 2, memory_order_release);
+}
+
+// Status page is optional, clients can always fall back to the socket
+void open_status_page(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        printf("Cannot create status page: %s\n", strerror(errno));
+        return;
+    }
+
+    if (ftruncate(fd, sizeof(StatusPage)) == -1) {
+        printf("Cannot resize status page: %s\n", strerror(errno));
+        close(fd);
+        unlink(path);
+        return;
+    }
+
+    StatusPage* page = mmap(NULL, sizeof(StatusPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        printf("Cannot map status page: %s\n" SUB("Lost without a map"), strerror(errno));
+        unlink(path);
+        return;
+    }
+
+    page->magic = STATUS_PAGE_MAGIC;
+    page->version = STATUS_PAGE_VERSION;
+    strncpy(status_path, path, PATH_LEN - 1);
+    status_page = page;
+    publish_status();
+    printf("Publishing status at: %s\n", path);
+}
+
+void close_status_page(void) {
+    if (!status_page) return;
+    munmap(status_page, sizeof(StatusPage));
+    unlink(status_path);
+    status_page = NULL;
+}
+
+// Audio files are read through a mapping of the whole file, so decoders
+// reading a few KiB at a time cost a memcpy instead of a read syscall. The
+// kernel is told to read ahead of the cursor and may drop what's behind it.
+// With --readahead, files are read by io_thread instead, in large blocks
+// ahead of the cursor, so decoders don't wait on slow disks or network
+// filesystems. Files that can't be mapped, like pipes, go through
+// miniaudio's own vfs
+typedef struct {
+    ma_vfs_callbacks cb; // Must be first, miniaudio calls it with a pointer to this
+    ma_default_vfs fallback;
+} FileVfs;
+
+typedef enum {
+    FILE_FALLBACK,
+    FILE_MAPPED,
+    FILE_READAHEAD,
+} FileKind;
+
+typedef struct VfsFile VfsFile;
+
+struct VfsFile {
+    FileKind kind;
+    ma_vfs_file fallback;
+    size_t size;
+    size_t pos;
+
+    uint8_t* data;
+    size_t advised; // Everything below this was already passed to MADV_WILLNEED
+
+    // blocks[(head + i) % READAHEAD_BLOCKS] holds the file from
+    // ring_start + i * readahead_block on, for i < filled. Everything but
+    // fd and blocks is guarded by io_lock
+    int fd;
+    char path[PATH_LEN];
+    uint8_t* blocks[READAHEAD_BLOCKS];
+    size_t block_len[READAHEAD_BLOCKS];
+    size_t ring_start;
+    int head;
+    int filled;
+    bool io_busy;        // io_thread is reading the block after the filled ones
+    unsigned generation; // Changes when the ring is dropped, so a read in flight is too
+    int error;
+    VfsFile* next_io;
+};
+
+FileVfs file_vfs;
+
+size_t readahead_block = 0; // Bytes, 0 maps files instead
+pthread_t io_thread;
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_work = PTHREAD_COND_INITIALIZER; // io_thread waits for blocks to free up
+pthread_cond_t io_done = PTHREAD_COND_INITIALIZER; // Readers wait for blocks to be read
+VfsFile* io_files = NULL;
+bool io_running = false;
+
+// Buffer health, guarded by io_lock
+uint64_t io_reads = 0;
+uint64_t io_bytes = 0;
+uint64_t io_stalls = 0; // Reads that had to wait for io_thread
+uint64_t io_stall_ns = 0;
+uint64_t io_max_stall_ns = 0;
+
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Asks for the next window to be read in before the decoder gets there
+void advise_ahead(VfsFile* f) {
+    if (f->pos + MAP_ADVISE_LEN / 2 < f->advised || f->advised >= f->size) return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    // Seeks may go past the end
+    size_t start = (f->pos < f->size ? f->pos : f->size) & ~(page - 1);
+    size_t end = f->pos + MAP_ADVISE_LEN;
+    if (end > f->size) end = f->size;
+    madvise(f->data + start, end - start, MADV_WILLNEED);
+    f->advised = end;
+}
+
+// Bytes read ahead of the cursor
+size_t buffered_ahead(VfsFile* f) {
+    size_t end = f->ring_start;
+    for (int i = 0; i < f->filled; i++) end += f->block_len[(f->head + i) % READAHEAD_BLOCKS];
+    return end > f->pos ? end - f->pos : 0;
+}
+
+bool needs_readahead(VfsFile* f) {
+    return !f->error && f->filled < READAHEAD_BLOCKS && f->ring_start + f->filled * readahead_block < f->size;
+}
+
+ssize_t pread_full(int fd, uint8_t* buf, size_t len, size_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Keeps every open file's ring full, the one with the least buffered first
+void* run_io_thread(void* arg) {
+    (void) arg;
+    trace_thread_name = "readahead";
+    pthread_mutex_lock(&io_lock);
+    while (io_running) {
+        VfsFile* f = NULL;
+        for (VfsFile* i = io_files; i; i = i->next_io) {
+            if (needs_readahead(i) && (!f || buffered_ahead(i) < buffered_ahead(f))) f = i;
+        }
+        if (!f) {
+            pthread_cond_wait(&io_work, &io_lock);
+            continue;
+        }
+
+        int slot = (f->head + f->filled) % READAHEAD_BLOCKS;
+        size_t off = f->ring_start + f->filled * readahead_block;
+        unsigned generation = f->generation;
+        f->io_busy = true;
+        pthread_mutex_unlock(&io_lock);
+
+        uint64_t start = trace_begin();
+        ssize_t n = pread_full(f->fd, f->blocks[slot], readahead_block, off);
+        int error = errno;
+        trace_end("io", "readahead", start);
+
+        pthread_mutex_lock(&io_lock);
+        f->io_busy = false;
+        if (f->generation == generation) {
+            if (n == -1) {
+                f->error = error;
+            } else {
+                f->block_len[slot] = n;
+                f->filled++;
+                io_reads++;
+                io_bytes += n;
+            }
+        }
+        pthread_cond_broadcast(&io_done);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+// Drops the ring and starts filling it again from the block holding `pos`
+void reset_ring(VfsFile* f) {
+    f->ring_start = f->pos - f->pos % readahead_block;
+    f->head = 0;
+    f->filled = 0;
+    f->generation++;
+    pthread_cond_signal(&io_work);
+}
+
+ma_result read_ahead(VfsFile* f, uint8_t* dst, size_t size, size_t* bytes_read) {
+    size_t done = 0;
+    pthread_mutex_lock(&io_lock);
+    while (done < size && f->pos < f->size && !f->error) {
+        // Frees the blocks the cursor has left behind for io_thread to fill
+        while (f->filled > 0 && f->pos >= f->ring_start + readahead_block) {
+            f->ring_start += readahead_block;
+            f->head = (f->head + 1) % READAHEAD_BLOCKS;
+            f->filled--;
+            pthread_cond_signal(&io_work);
+        }
+        if (f->pos < f->ring_start || f->pos >= f->ring_start + (f->filled + 1) * readahead_block) reset_ring(f);
+
+        if (f->filled == 0) {
+            uint64_t start = now_ns();
+            while (f->filled == 0 && !f->error) pthread_cond_wait(&io_done, &io_lock);
+            uint64_t stall = now_ns() - start;
+            io_stalls++;
+            io_stall_ns += stall;
+            if (stall > io_max_stall_ns) io_max_stall_ns = stall;
+            continue;
+        }
+
+        size_t offset = f->pos - f->ring_start;
+        size_t len = f->block_len[f->head];
+        if (offset >= len) break; // The file got shorter
+        size_t n = len - offset < size - done ? len - offset : size - done;
+        memcpy(dst + done, f->blocks[f->head] + offset, n);
+        f->pos += n;
+        done += n;
+    }
+    int error = f->error;
+    pthread_mutex_unlock(&io_lock);
+
+    if (bytes_read) *bytes_read = done;
+    if (done == 0 && error) return MA_IO_ERROR;
+    return done == 0 && size > 0 ? MA_AT_END : MA_SUCCESS;
+}
+
+bool open_readahead(VfsFile* f, int fd, const char* path) {
+    for (int i = 0; i < READAHEAD_BLOCKS; i++) {
+        if (posix_memalign((void**)&f->blocks[i], 4096, readahead_block) != 0) {
+            f->blocks[i] = NULL;
+            return false;
+        }
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    f->kind = FILE_READAHEAD;
+    f->fd = fd;
+    strncpy(f->path, path, PATH_LEN - 1);
+
+    pthread_mutex_lock(&io_lock);
+    f->next_io = io_files;
+    io_files = f;
+    pthread_cond_signal(&io_work);
+    pthread_mutex_unlock(&io_lock);
+    return true;
+}
+
+// io_thread may still be reading into one of the blocks
+void close_readahead(VfsFile* f) {
+    pthread_mutex_lock(&io_lock);
+    VfsFile** link = &io_files;
+    while (*link != f) link = &(*link)->next_io;
+    *link = f->next_io;
+    while (f->io_busy) pthread_cond_wait(&io_done, &io_lock);
+    pthread_mutex_unlock(&io_lock);
+    close(f->fd);
+}
+
+ma_result vfs_open(ma_vfs* vfs, const char* path, ma_uint32 mode, ma_vfs_file* file) {
+    FileVfs* v = (FileVfs*)vfs;
+    VfsFile* f = calloc(1, sizeof(VfsFile));
+    if (!f) return MA_OUT_OF_MEMORY;
+
+    int fd = mode == MA_OPEN_MODE_READ ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        f->size = st.st_size;
+        if (readahead_block > 0) {
+            if (open_readahead(f, fd, path)) fd = -1;
+        } else {
+            // Pages past the end of a file truncated while it's mapped raise
+            // SIGBUS, which kills the daemon. Files that get rewritten in
+            // place need --readahead, which reads with pread instead
+            void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                f->kind = FILE_MAPPED;
+                f->data = data;
+                madvise(f->data, f->size, MADV_SEQUENTIAL);
+                advise_ahead(f);
+            }
+        }
+    }
+    if (fd != -1) close(fd);
+
+    if (f->kind == FILE_FALLBACK) {
+        for (int i = 0; i < READAHEAD_BLOCKS; i++) free(f->blocks[i]);
+        ma_result result = ma_vfs_open(&v->fallback, path, mode, &f->fallback);
+        if (result != MA_SUCCESS) {
+            free(f);
+            return result;
+        }
+    }
+    *file = f;
+    return MA_SUCCESS;
+}
+
+ma_result vfs_open_w(ma_vfs* vfs, const wchar_t* path, ma_uint32 mode, ma_vfs_file* file) {
+    (void) vfs;
+    (void) path;
+    (void) mode;
+    (void) file;
+    return MA_NOT_IMPLEMENTED;
+}
+
+ma_result vfs_close(ma_vfs* vfs, ma_vfs_file file) {
+    VfsFile* f = file;
+    if (f->kind == FILE_MAPPED) {
+        munmap(f->data, f->size);
+    } else if (f->kind == FILE_READAHEAD) {
+        close_readahead(f);
+        for (int i = 0; i < READAHEAD_BLOCKS; i++) free(f->blocks[i]);
+    } else {
+        ma_vfs_close(&((FileVfs*)vfs)->fallback, f->fallback);
+    }
+    free(f);
+    return MA_SUCCESS;
+}
+
+ma_result read_mapped(VfsFile* f, void* dst, size_t size, size_t* bytes_read) {
+    size_t n = f->pos < f->size ? f->size - f->pos : 0;
+    if (n > size) n = size;
+    memcpy(dst, f->data + f->pos, n);
+    f->pos += n;
+    if (bytes_read) *bytes_read = n;
+    advise_ahead(f);
+    return n == 0 && size > 0 ? MA_AT_END : MA_SUCCESS;
+}
+
+// Called on the job threads, so their spans show the decoders at work
+ma_result vfs_read(ma_vfs* vfs, ma_vfs_file file, void* dst, size_t size, size_t* bytes_read) {
+    VfsFile* f = file;
+    uint64_t start = trace_begin();
+    ma_result result;
+    if (f->kind == FILE_FALLBACK) {
+        result = ma_vfs_read(&((FileVfs*)vfs)->fallback, f->fallback, dst, size, bytes_read);
+    } else if (f->kind == FILE_READAHEAD) {
+        result = read_ahead(f, dst, size, bytes_read);
+    } else {
+        result = read_mapped(f, dst, size, bytes_read);
+    }
+    trace_end("decoder", "file read", start);
+    return result;
+}
+
+ma_result vfs_write(ma_vfs* vfs, ma_vfs_file file, const void* src, size_t size, size_t* bytes_written) {
+    VfsFile* f = file;
+    if (f->kind == FILE_FALLBACK) return ma_vfs_write(&((FileVfs*)vfs)->fallback, f->fallback, src, size, bytes_written);
+    return MA_ACCESS_DENIED;
+}
+
+// A readahead file only moves its ring once it's read from at the new position
+ma_result vfs_seek(ma_vfs* vfs, ma_vfs_file file, ma_int64 offset, ma_seek_origin origin) {
+    VfsFile* f = file;
+    if (f->kind == FILE_FALLBACK) return ma_vfs_seek(&((FileVfs*)vfs)->fallback, f->fallback, offset, origin);
+
+    if (f->kind == FILE_READAHEAD) pthread_mutex_lock(&io_lock);
+    ma_int64 base = origin == ma_seek_origin_start ? 0 : origin == ma_seek_origin_current ? (ma_int64)f->pos : (ma_int64)f->size;
+    bool valid = base + offset >= 0;
+    if (valid) f->pos = base + offset;
+    if (f->kind == FILE_READAHEAD) pthread_mutex_unlock(&io_lock);
+    if (!valid) return MA_BAD_SEEK;
+
+    if (f->kind == FILE_MAPPED) {
+        // Whatever was advised before is of no use after jumping around
+        f->advised = 0;
+        advise_ahead(f);
+    }
+    return MA_SUCCESS;
+}
+
+ma_result vfs_tell(ma_vfs* vfs, ma_vfs_file file, ma_int64* cursor) {
+    VfsFile* f = file;
+    if (f->kind == FILE_FALLBACK) return ma_vfs_tell(&((FileVfs*)vfs)->fallback, f->fallback, cursor);
+    *cursor = f->pos;
+    return MA_SUCCESS;
+}
+
+ma_result vfs_info(ma_vfs* vfs, ma_vfs_file file, ma_file_info* info) {
+    VfsFile* f = file;
+    if (f->kind == FILE_FALLBACK) return ma_vfs_info(&((FileVfs*)vfs)->fallback, f->fallback, info);
+    info->sizeInBytes = f->size;
+    return MA_SUCCESS;
+}
+
+bool init_file_vfs(void) {
+    file_vfs.cb = (ma_vfs_callbacks) {
+        .onOpen = vfs_open,
+        .onOpenW = vfs_open_w,
+        .onClose = vfs_close,
+        .onRead = vfs_read,
+        .onWrite = vfs_write,
+        .onSeek = vfs_seek,
+        .onTell = vfs_tell,
+        .onInfo = vfs_info,
+    };
+    if (ma_default_vfs_init(&file_vfs.fallback, NULL) != MA_SUCCESS) return false;
+
+    if (readahead_block > 0) {
+        io_running = true;
+        if (pthread_create(&io_thread, NULL, run_io_thread, NULL) != 0) {
+            printf("Cannot start readahead thread, mapping files instead\n");
+            io_running = false;
+            readahead_block = 0;
+        }
+    }
+    return true;
+}
+
+// Only once the engine is gone, nothing reads files anymore by then
+void stop_io_thread(void) {
+    if (!io_running) return;
+    pthread_mutex_lock(&io_lock);
+    io_running = false;
+    pthread_cond_signal(&io_work);
+    pthread_mutex_unlock(&io_lock);
+    pthread_join(io_thread, NULL);
+}
+
+bool runtime_path(char* path, size_t size, const char* name) {
+    char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char* next = stpncpy(path, runtime_dir ? runtime_dir : ".", size);
+    if (size - (next - path) < strlen(name) + 2) {
+        printf("Size of environment variable is too large\n");
+        return false;
+    }
+    *next++ = '/';
+    stpncpy(next, name, size - (next - path));
+    return true;
+}
+
+char* cut_and_get_next_word(char* inp) {
+    if (!*inp) return inp;
+    while (*inp != ' ' && *inp != '\n' && *inp != '\0') inp++;
+    if (*inp == '\0') return inp;
+    *inp = '\0';
+    inp++;
+
+    while (*inp == ' ' || *inp == '\n') inp++;
+    return inp;
+}
+
+void print_time(float t, Output* out) {
+    out_printf(out, "%02d:%02d", (int)fmodf(t / 60.0f, 60.0f), (int)fmodf(t, 60.0f));
+}
+
+void print_status(Output* out) {
+    if (!is_playing()) {
+        out_printf(out, "stopped\n");
+        return;
+    }
+
+    ma_uint64 cursor, length;
+    ma_uint32 sample_rate;
+    const char* name = get_heard_track(&cursor, &length, &sample_rate);
+    out_printf(out, "[");
+    print_time(sample_rate ? (float)cursor / sample_rate : 0.0f, out);
+    out_printf(out, "/");
+    print_time(sample_rate ? (float)length / sample_rate : 0.0f, out);
+
+    out_printf(out, "] - %s", *name != '\0' ? name : "unnamed");
+    if (loop) out_printf(out, " loop");
+    out_printf(out, "\n");
+}
+
+// Parses a list of subsystem names, no names meaning all of them.
+// Returns 0 and complains if one of them is unknown
+unsigned parse_changes(char* args, Output* out) {
+    if (args[0] == '\0') return CHANGE_ALL;
+
+    unsigned changes = 0;
+    while (args[0] != '\0') {
+        char* name = args;
+        args = cut_and_get_next_word(args);
+
+        size_t i;
+        for (i = 0; i < ARRLEN(change_names); i++) {
+            if (!strcmp(name, change_names[i])) break;
+        }
+        if (i == ARRLEN(change_names)) {
+            out_printf(out, "unknown subsystem: %s\n", name);
+            return 0;
+        }
+        changes |= 1 << i;
+    }
+    return changes;
+}
+
+void resume_task(Task* t);
+
+// Finds the client that asked for something, unless it left in the meantime
+Task* get_requester(int fd, uint64_t id) {
+    Task* t = get_task(fd);
+    if (!t || t->delete || t->id != id) return NULL;
+    return t;
+}
+
+ssize_t queue_index(uint64_t entry_id) {
+    for (size_t i = 0; i < queue_len; i++) {
+        if (queue[i].id == entry_id) return i;
+    }
+    return -1;
+}
+
+// Position of the playing track, -1 if nothing plays or it was removed
+ssize_t current_index(void) {
+    return current_track ? queue_index(current_track->entry_id) : -1;
+}
+
+QueueEntry* next_entry(void) {
+    size_t i = current_index() + 1;
+    return i < queue_len ? &queue[i] : NULL;
+}
+
+QueueEntry* insert_entry(size_t pos, const char* path) {
+    if (queue_len == queue_cap) {
+        size_t new_cap = queue_cap ? queue_cap * 2 : 16;
+        QueueEntry* new_queue = realloc(queue, new_cap * sizeof(QueueEntry));
+        if (!new_queue) return NULL;
+        queue = new_queue;
+        queue_cap = new_cap;
+    }
+
+    char* entry_path = strdup(path);
+    char* name_buf = strdup(path);
+    char* name = name_buf ? strdup(basename(name_buf)) : NULL;
+    free(name_buf);
+    if (!entry_path || !name) {
+        free(entry_path);
+        free(name);
+        return NULL;
+    }
+
+    memmove(&queue[pos + 1], &queue[pos], (queue_len - pos) * sizeof(QueueEntry));
+    queue_len++;
+    queue[pos] = (QueueEntry) {
+        .id = ++last_entry_id,
+        .path = entry_path,
+        .name = name,
+    };
+    return &queue[pos];
+}
+
+void clear_queue(void) {
+    for (size_t i = 0; i < queue_len; i++) {
+        free(queue[i].path);
+        free(queue[i].name);
+    }
+    queue_len = 0;
+}
+
+// Called on a resource manager job thread
+void on_track_loaded(ma_async_notification* notification) {
+    Track* track = (Track*)notification;
+    atomic_store(&track->loaded, true);
+    atomic_store(&tracks_loaded, true);
+    wake_event_loop();
+}
+
+// Called on the audio thread when the current track ends
+ma_data_source* on_track_end(ma_data_source* source) {
+    (void) source;
+    Track* next = atomic_exchange(&chained_track, NULL);
+    if (!next) return NULL;
+    mark_render(&advance_mark);
+
+    // advance_track tells the clients, unless it's the same entry looping on
+    atomic_store(&track_advanced, true);
+    wake_event_loop();
+    return &next->reader;
+}
+
+// A track's voice reads it through `reader`, which passes everything on to
+// the resource manager's source and counts the reads the decoder wasn't
+// ready for, where the voice plays silence instead. With --deep-buffer it
+// also tells render_thread when the decoder is about to fall behind
+Track* reader_track(ma_data_source* reader) {
+    return (Track*)((char*)reader - offsetof(Track, reader));
+}
+
+// Whether the track has RENDER_AHEAD frames decoded past its cursor, or all
+// of them. Unknown lengths count as not decoded to the end
+bool track_ready(Track* track) {
+    ma_uint64 available = 0, cursor = 0, length = 0;
+    ma_resource_manager_data_source_get_available_frames(&track->source, &available);
+    if (available >= RENDER_AHEAD) return true;
+    ma_data_source_get_cursor_in_pcm_frames(&track->source, &cursor);
+    ma_data_source_get_length_in_pcm_frames(&track->source, &length);
+    return length > 0 && cursor + available >= length;
+}
+
+ma_result read_track(ma_data_source* reader, void* out, ma_uint64 frames, ma_uint64* frames_read) {
+    ma_uint64 read = 0;
+    uint64_t start = trace_begin();
+    ma_result result = ma_data_source_read_pcm_frames(&reader_track(reader)->source, out, frames, &read);
+    trace_end("audio", "decoder read", start);
+    atomic_fetch_add_explicit(&decoded_frames, read, memory_order_relaxed);
+    if (deep_buffer && (result == MA_BUSY || !track_ready(reader_track(reader)))) {
+        atomic_store(&decoder_behind, true);
+    }
+    if (result == MA_BUSY) {
+        atomic_fetch_add_explicit(&starved_reads, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&starved_frames, frames - read, memory_order_relaxed);
+    }
+    if (frames_read) *frames_read = read;
+    return result;
+}
+
+ma_result seek_reader(ma_data_source* reader, ma_uint64 frame) {
+    return ma_data_source_seek_to_pcm_frame(&reader_track(reader)->source, frame);
+}
+
+ma_result get_reader_format(ma_data_source* reader, ma_format* format, ma_uint32* channels,
+        ma_uint32* sample_rate, ma_channel* channel_map, size_t channel_map_cap) {
+    return ma_data_source_get_data_format(&reader_track(reader)->source, format, channels, sample_rate,
+        channel_map, channel_map_cap);
+}
+
+ma_result get_reader_cursor(ma_data_source* reader, ma_uint64* cursor) {
+    return ma_data_source_get_cursor_in_pcm_frames(&reader_track(reader)->source, cursor);
+}
+
+ma_result get_reader_length(ma_data_source* reader, ma_uint64* length) {
+    return ma_data_source_get_length_in_pcm_frames(&reader_track(reader)->source, length);
+}
+
+ma_data_source_vtable track_reader = {
+    .onRead = read_track,
+    .onSeek = seek_reader,
+    .onGetDataFormat = get_reader_format,
+    .onGetCursor = get_reader_cursor,
+    .onGetLength = get_reader_length,
+};
+
+CacheEntry* find_cached(const char* path) {
+    for (CacheEntry* e = cache_head; e; e = e->next) {
+        if (!strcmp(e->path, path)) return e;
+    }
+    return NULL;
+}
+
+void unlink_cached(CacheEntry* e) {
+    if (e->prev) e->prev->next = e->next; else cache_head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache_tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+void push_cached(CacheEntry* e) {
+    e->next = cache_head;
+    if (cache_head) cache_head->prev = e;
+    cache_head = e;
+    if (!cache_tail) cache_tail = e;
+}
+
+// Tracks still playing the file keep their own reference, so the memory is
+// only released once they are done with it
+void unpin_cached(CacheEntry* e) {
+    if (!e->pinned) return;
+    ma_resource_manager_data_source_uninit(&e->pin);
+    e->pinned = false;
+    cache_used -= e->bytes;
+    cache_ghosts++;
+}
+
+void drop_cached(CacheEntry* e) {
+    unpin_cached(e);
+    unlink_cached(e);
+    cache_ghosts--;
+    free(e);
+}
+
+// Unpins the least recently played files until `bytes` more fit, and
+// forgets the oldest unpinned ones past CACHE_GHOSTS
+void evict_cached(size_t bytes) {
+    CacheEntry* prev;
+    for (CacheEntry* e = cache_tail; e && cache_used + bytes > cache_budget; e = prev) {
+        prev = e->prev;
+        unpin_cached(e);
+    }
+    for (CacheEntry* e = cache_tail; e && cache_ghosts > CACHE_GHOSTS; e = prev) {
+        prev = e->prev;
+        if (!e->pinned) drop_cached(e);
+    }
+}
+
+// Whether the file was played recently and its decoded samples fit in
+// memory, in which case it's decoded up front. Once that's done, loops
+// and replays don't touch the file or the decoder anymore. With
+// --offline everything is, streams can't page in fast enough for
+// rendering nonstop
+bool should_decode(const char* path) {
+    if (offline) return true;
+    CacheEntry* e = find_cached(path);
+    return e && e->bytes <= cache_budget;
+}
+
+// Remembers a track that starts playing as the most recently played
+// file, and pins its decoded copy if it has one
+void cache_track(Track* track) {
+    if (cache_budget == 0) return;
+
+    ma_uint64 length = 0;
+    ma_uint32 channels = 0;
+    ma_data_source_get_length_in_pcm_frames(&track->source, &length);
+    ma_data_source_get_data_format(&track->source, NULL, &channels, NULL, NULL, 0);
+
+    CacheEntry* e = find_cached(track->path);
+    if (e) {
+        unlink_cached(e);
+    } else {
+        e = calloc(1, sizeof(CacheEntry));
+        if (!e) return;
+        snprintf(e->path, sizeof(e->path), "%s", track->path);
+        cache_ghosts++;
+    }
+    e->bytes = length * channels * sizeof(float);
+    push_cached(e);
+
+    if (track->decoded && !e->pinned && e->bytes <= cache_budget) {
+        evict_cached(e->bytes);
+
+        // Finds the data the track is using, so nothing gets decoded here
+        ma_resource_manager_data_source_config config = ma_resource_manager_data_source_config_init();
+        config.pFilePath = e->path;
+        config.flags = MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_DECODE | MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_ASYNC;
+        if (ma_resource_manager_data_source_init_ex(ma_engine_get_resource_manager(&audio), &config, &e->pin) == MA_SUCCESS) {
+            e->pinned = true;
+            cache_used += e->bytes;
+            cache_ghosts--;
+        }
+    }
+    evict_cached(0);
+}
+
+void free_cache(void) {
+    while (cache_head) drop_cached(cache_head);
+}
+
+// Only one load per role is in flight, a newer one cancels the older
+void cancel_loads(TrackRole role) {
+    for (Track* t = loading_tracks; t; t = t->next) {
+        if (t->cancelled || t->role != role) continue;
+        t->cancelled = true;
+        Task* r = get_requester(t->reply_fd, t->reply_id);
+        if (r) {
+            out_printf(&r->out, "cancelled \"%s\"\n", t->path);
+            resume_task(r);
+        }
+    }
+}
+
+Track* find_load(TrackRole role) {
+    for (Track* t = loading_tracks; t; t = t->next) {
+        if (!t->cancelled && t->role == role) return t;
+    }
+    return NULL;
+}
+
+// Starts loading a queue entry in the background. The requesting task, if
+// any, stops running commands until the track is loaded and it got the answer
+bool load_track(QueueEntry* entry, TrackRole role, Task* requester) {
+    Track* track = calloc(1, sizeof(Track));
+    if (!track) return false;
+
+    track->loaded_cb.onSignal = on_track_loaded;
+    track->role = role;
+    track->entry_id = entry->id;
+    track->decoded = should_decode(entry->path);
+    CacheEntry* cached = find_cached(entry->path);
+    if (cached && cached->pinned) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    strncpy(track->path, entry->path, PATH_LEN - 1);
+    track->reply_fd = requester ? requester->fd : -1;
+    track->reply_id = requester ? requester->id : 0;
+
+    ma_resource_manager_pipeline_notifications notifications = ma_resource_manager_pipeline_notifications_init();
+    // Rendered nonstop, a track would run into frames not decoded yet.
+    // render_thread waits for the decoder instead, see track_ready
+    if (offline) {
+        notifications.done.pNotification = &track->loaded_cb;
+    } else {
+        notifications.init.pNotification = &track->loaded_cb;
+    }
+
+    ma_resource_manager_data_source_config config = ma_resource_manager_data_source_config_init();
+    config.pFilePath = track->path;
+    config.pNotifications = sync_load ? NULL : &notifications;
+    config.flags = sync_load ? 0 : MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_ASYNC;
+    config.flags |= track->decoded ? MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_DECODE : MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_STREAM;
+
+    if (ma_resource_manager_data_source_init_ex(ma_engine_get_resource_manager(&audio), &config, &track->source) != MA_SUCCESS) {
+        free(track);
+        return false;
+    }
+    ma_data_source_config reader_config = ma_data_source_config_init();
+    reader_config.vtable = &track_reader;
+    ma_data_source_init(&reader_config, &track->reader);
+    ma_data_source_set_next_callback(&track->reader, on_track_end);
+    if (sync_load) on_track_loaded((ma_async_notification*)&track->loaded_cb);
+
+    cancel_loads(role);
+    track->next = loading_tracks;
+    loading_tracks = track;
+    if (requester) requester->waiting = true;
+    return true;
+}
+
+// A track looping into a decoded copy of itself
+bool next_is_loop_copy(void) {
+    return next_chained && next_track->entry_id == current_track->entry_id;
+}
+
+// The chain head loops the current track, except while a decoded copy is
+// chained after it, which takes over the looping once it's reached
+void apply_settings(Voice* v) {
+    if (!v->live) return;
+    ma_sound_set_looping(&v->sound, loop && !next_is_loop_copy());
+    queue_audio_command((AudioCommand) { .type = AUDIO_PITCH, .target = v, .value = pitch / 100.0f });
+}
+
+void apply_settings_to_voices(void) {
+    for (size_t i = 0; i < ARRLEN(voices); i++) apply_settings(&voices[i]);
+}
+
+// Sets up a stopped voice for the track, with its chain in the track's format
+bool init_voice(Voice* v, Track* track) {
+    ma_uint32 channels = 0, sample_rate = 0;
+    ma_data_source_get_data_format(&track->source, NULL, &channels, &sample_rate, NULL, 0);
+    ma_audio_buffer_ref_init(ma_format_f32, channels, NULL, 0, &v->head);
+    v->head.sampleRate = sample_rate;
+    ma_data_source_set_current(&v->head, &track->reader);
+
+    if (ma_sound_init_from_data_source(&audio, &v->head, 0, &voice_group, &v->sound) != MA_SUCCESS) {
+        memset(v, 0, sizeof(Voice));
+        return false;
+    }
+    ma_sound_set_end_callback(&v->sound, on_sound_end, NULL);
+    v->live = true;
+    apply_settings(v);
+    return true;
+}
+
+void uninit_voice(Voice* v) {
+    if (!v->live) return;
+    sync_commands();
+    ma_sound_uninit(&v->sound);
+    memset(v, 0, sizeof(Voice));
+}
+
+// The job thread must be done with the source before it's uninitialized,
+// otherwise this would block until it is
+void free_track(Track* track) {
+    if (track->voice) uninit_voice(track->voice);
+    sync_commands();
+    if (track == seek_track) seek_track = NULL;
+    ma_data_source_uninit(&track->reader);
+    ma_resource_manager_data_source_uninit(&track->source);
+    free(track);
+}
+
+// Undoes schedule_crossfade, leaving both voices at full volume
+void cancel_crossfade(void) {
+    if (!crossfading) return;
+    crossfading = false;
+    ma_sound_set_fade_in_pcm_frames(&voice->sound, -1, 1, 0);
+    if (!next_armed) return;
+
+    Voice* next = next_track->voice;
+    ma_sound_stop(&next->sound);
+    ma_sound_set_fade_in_pcm_frames(&next->sound, 1, 1, 0);
+    ma_data_source_seek_to_pcm_frame(&next_track->source, 0);
+}
+
+// Starts the next voice on the engine clock so that it fades in while the
+// current track fades out over its last `crossfade` seconds. The times are
+// estimated from the current position, so this is redone whenever the
+// position or speed changes. If the estimate is off, the end callback still
+// starts the next voice once the current one runs out
+void schedule_crossfade(void) {
+    cancel_crossfade();
+    if (crossfade <= 0.0f || loop || !next_armed || !is_playing()) return;
+
+    ma_uint64 cursor = track_cursor(current_track), length = 0;
+    ma_uint32 sample_rate = 0;
+    ma_data_source_get_length_in_pcm_frames(&current_track->source, &length);
+    ma_data_source_get_data_format(&current_track->source, NULL, NULL, &sample_rate, NULL, 0);
+    if (sample_rate == 0 || cursor >= length) return;
+
+    ma_uint32 engine_rate = ma_engine_get_sample_rate(&audio);
+    ma_uint64 remaining = (double)(length - cursor) * engine_rate / sample_rate / (pitch / 100.0f);
+    ma_uint64 fade = crossfade * engine_rate;
+    if (fade > remaining) fade = remaining;
+    ma_uint64 start = ma_engine_get_time_in_pcm_frames(&audio) + remaining - fade;
+
+    Voice* next = next_track->voice;
+    ma_sound_set_fade_in_pcm_frames(&next->sound, 0, 1, fade);
+    ma_sound_set_start_time_in_pcm_frames(&next->sound, start);
+    ma_sound_start(&next->sound);
+    ma_sound_set_fade_start_in_pcm_frames(&voice->sound, -1, 0, fade, start);
+    crossfading = true;
+}
+
+// Takes next_track back from the audio thread. If the audio thread already
+// switched to it, the switch is finished here first and there is nothing
+// left to take
+Track* unchain_next_track(void) {
+    if (!next_track) return NULL;
+    if ((next_chained && !atomic_exchange(&chained_track, NULL)) ||
+        (next_armed && !atomic_exchange(&armed_voice, NULL))) {
+        advance_track();
+        return NULL;
+    }
+
+    cancel_crossfade();
+    Track* track = next_track;
+    next_track = NULL;
+    next_chained = false;
+    next_armed = false;
+    apply_settings(voice);
+    return track;
+}
+
+// Hands the loaded next track to the audio thread. The chain reads every
+// source with the format of its head, so a track with a different channel
+// count or sample rate gets a voice of its own instead, as does every track
+// when crossfading. Its decoder is open and the first pages are decoded by
+// then, so either way the track starts without waiting for anything
+void chain_next_track(Track* track) {
+    next_track = track;
+
+    ma_uint32 channels = 0, sample_rate = 0;
+    ma_data_source_get_data_format(&track->source, NULL, &channels, &sample_rate, NULL, 0);
+    bool loop_copy = track->entry_id == current_track->entry_id;
+    if ((crossfade <= 0.0f || loop_copy) && channels == voice->head.channels && sample_rate == voice->head.sampleRate) {
+        if (track->voice) uninit_voice(track->voice);
+        track->voice = NULL;
+        next_chained = true;
+        atomic_store(&chained_track, track);
+        apply_settings(voice);
+        return;
+    }
+
+    if (!track->voice) {
+        Voice* spare = voice == &voices[0] ? &voices[1] : &voices[0];
+        if (!init_voice(spare, track)) return; // Started the slow way by end_chain
+        track->voice = spare;
+    }
+    next_armed = true;
+    atomic_store(&armed_voice, track->voice);
+    schedule_crossfade();
+}
+
+// The entry to load after the current track. With loop on, a streamed
+// track is followed by a copy of itself decoded into memory, so the
+// following iterations don't decode anything
+QueueEntry* wanted_next_entry(void) {
+    if (!current_track) return NULL;
+    if (!loop) return next_entry();
+    if (current_track->decoded || !should_decode(current_track->path)) return NULL;
+    ssize_t i = current_index();
+    return i >= 0 ? &queue[i] : NULL;
+}
+
+// Makes sure the entry after the current one is loaded and chained
+void prepare_next_track(void) {
+    QueueEntry* entry = wanted_next_entry();
+    if (next_track && entry && next_track->entry_id == entry->id) return;
+
+    if (next_track) {
+        Track* old = unchain_next_track();
+        if (!old) return; // advance_track() prepared the track after the new one
+        free_track(old);
+    }
+
+    Track* loading = find_load(TRACK_NEXT);
+    if (loading && entry && loading->entry_id == entry->id) return;
+    if (!entry) {
+        cancel_loads(TRACK_NEXT);
+        return;
+    }
+    // A file that can't be opened is reported by end_chain, which tries it again
+    load_track(entry, TRACK_NEXT, NULL);
+}
+
+// Taking the next track back first, so the audio thread can't switch to it
+// while the current one goes away
+void stop_current_track(void) {
+    if (!current_track) return;
+    Track* old = unchain_next_track();
+    if (old) free_track(old);
+    uninit_voice(voice);
+    free_track(current_track);
+    current_track = NULL;
+}
+
+// Plays the track on its warmed up voice if it has one
+void start_track(Track* track) {
+    flush_render();
+    stop_current_track();
+    *running_filepath = '\0';
+    notify(CHANGE_TRACK | CHANGE_PLAYER);
+
+    if (track->voice) {
+        voice = track->voice;
+        track->voice = NULL;
+    } else if (!init_voice(voice, track)) {
+        free_track(track);
+        return;
+    }
+    current_track = track;
+    strncpy(running_filepath, basename(track->path), PATH_LEN - 1);
+    ma_sound_start(&voice->sound);
+    cache_track(track);
+
+    prepare_next_track();
+}
+
+// The audio thread moved on to next_track, either within the chain or by
+// starting its voice
+void advance_track(void) {
+    if (next_chained && !atomic_load(&chained_track)) {
+        // Same voice, it just reads another source now
+    } else if (next_armed && !atomic_load(&armed_voice)) {
+        uninit_voice(voice);
+        voice = next_track->voice;
+        next_track->voice = NULL;
+        crossfading = false;
+    } else {
+        return;
+    }
+
+    bool same_entry = next_track->entry_id == current_track->entry_id;
+    hold_change(same_entry ? 0 : CHANGE_TRACK, atomic_load(&advance_mark));
+    free_track(current_track);
+    current_track = next_track;
+    next_track = NULL;
+    next_chained = false;
+    next_armed = false;
+    apply_settings(voice);
+    strncpy(running_filepath, basename(current_track->path), PATH_LEN - 1);
+    cache_track(current_track);
+    prepare_next_track();
+}
+
+// Starts the first entry from `i` on that can be opened, so a missing file
+// doesn't hold up the rest of the queue
+void start_from(size_t i) {
+    for (; i < queue_len; i++) {
+        if (load_track(&queue[i], TRACK_START, NULL)) return;
+        printf("cant load file %s\n" SUB("Can't even load files in this country"), queue[i].path);
+    }
+}
+
+// The chain ran out, which happens when the next track was not ready in
+// time or could not be chained. Starting it now at least keeps the queue going
+void end_chain(void) {
+    if (!current_track || !ma_sound_at_end(&voice->sound)) return;
+
+    if (next_track) {
+        Track* track = unchain_next_track();
+        if (track) start_track(track);
+        return;
+    }
+
+    Track* loading = find_load(TRACK_NEXT);
+    if (loading) {
+        loading->role = TRACK_START;
+        return;
+    }
+
+    start_from(current_index() + 1);
+}
+
+void finish_track_load(Track* track) {
+    Task* requester = get_requester(track->reply_fd, track->reply_id);
+    Output* out = requester ? &requester->out : NULL;
+
+    if (track->cancelled) {
+        free_track(track);
+        return;
+    }
+
+    // Decoding into memory carries on after the track can start playing
+    ma_result result = ma_resource_manager_data_source_result(&track->source);
+    if (result != MA_SUCCESS && !(result == MA_BUSY && track->decoded)) {
+        // A next track is tried again as the one to start once the current
+        // one ends, which reports it
+        if (out) {
+            out_printf(out, "cant load file \"%s\"\n", track->path);
+            print_status(out);
+        } else if (track->role != TRACK_NEXT) {
+            printf("cant load file %s\n" SUB("Can't even load files in this country"), track->path);
+        }
+        ssize_t i = out || track->role == TRACK_NEXT ? -1 : queue_index(track->entry_id);
+        free_track(track);
+        if (i >= 0) start_from(i + 1);
+    } else if (track->role == TRACK_NEXT) {
+        QueueEntry* entry = wanted_next_entry();
+        if (entry && entry->id == track->entry_id && !next_track) {
+            chain_next_track(track);
+        } else {
+            free_track(track);
+        }
+    } else {
+        start_track(track);
+        if (out) {
+            out_printf(out, "Playing %s\n", running_filepath);
+        } else {
+            printf("Playing %s\n", running_filepath);
+        }
+    }
+
+    if (requester) resume_task(requester);
+}
+
+void finish_loaded_tracks(void) {
+    Track** link = &loading_tracks;
+    while (*link) {
+        Track* track = *link;
+        if (!atomic_load(&track->loaded)) {
+            link = &track->next;
+            continue;
+        }
+        *link = track->next;
+        finish_track_load(track);
+    }
+}
+
+void free_tracks(void) {
+    stop_current_track();
+    while (loading_tracks) {
+        Track* track = loading_tracks;
+        loading_tracks = track->next;
+        free_track(track);
+    }
+    clear_queue();
+    free(queue);
+    queue = NULL;
+    queue_cap = 0;
+}
+
+// Plays a queue entry, right away if it's the preloaded next track
+void skip_to(QueueEntry* entry, Task* t) {
+    if (next_track && next_track->entry_id == entry->id) {
+        Track* track = unchain_next_track();
+        if (track) {
+            start_track(track);
+            out_printf(&t->out, "Playing %s\n", running_filepath);
+            return;
+        }
+        // The audio thread got there first
+        if (current_track && current_track->entry_id == entry->id) {
+            out_printf(&t->out, "Playing %s\n", running_filepath);
+            return;
+        }
+    }
+
+    if (!load_track(entry, TRACK_START, t)) {
+        out_printf(&t->out, "cant load file \"%s\"\n", entry->path);
+        print_status(&t->out);
+    }
+}
+
+// Starts playback from where it stopped, or from the start of the track
+// once it has ended. The end of the chain leaves the head without a
+// current source, so it's pointed back at the track
+void resume_playback(void) {
+    if (!current_track) return;
+    if (ma_sound_at_end(&voice->sound)) {
+        // An ended sound stays started for a period, and starting a started
+        // sound doesn't clear its end
+        ma_sound_stop(&voice->sound);
+        ma_data_source_seek_to_pcm_frame(&current_track->source, 0);
+        ma_data_source_set_current(&voice->head, &current_track->reader);
+    }
+    ma_sound_start(&voice->sound);
+}
+
+void cmd_status(Task* t, char* args) {
+    (void) args;
+    print_status(&t->out);
+}
+
+void cmd_time(Task* t, char* args) {
+    (void) args;
+    float cur = 0.0f, len = 0.0f;
+    get_track_time(&cur, &len);
+    out_printf(&t->out, "%.3f\n%.3f\n", cur, len);
+}
+
+void cmd_seek(Task* t, char* args) {
+    flush_render();
+    if (!is_playing()) {
+        resume_playback();
+        notify(CHANGE_PLAYER);
+    }
+
+    float pos = atof(args);
+    float len = 0.0f;
+    if (current_track) ma_data_source_get_length_in_seconds(&current_track->source, &len);
+    if (!current_track || pos < 0.0f || pos > len) {
+        out_printf(&t->out, "invalid time\n");
+        return;
+    }
+
+    ma_uint32 sample_rate = 0;
+    ma_data_source_get_data_format(&current_track->source, NULL, NULL, &sample_rate, NULL, 0);
+    if (!queue_seek(current_track, (ma_uint64)(pos * sample_rate))) {
+        out_printf(&t->out, "cant seek\n");
+        return;
+    }
+    schedule_crossfade();
+    notify(CHANGE_PLAYER);
+    print_status(&t->out);
+}
+
+void cmd_loop(Task* t, char* args) {
+    (void) args;
+    flush_render();
+    loop = !loop;
+    apply_settings_to_voices();
+    prepare_next_track();
+    schedule_crossfade();
+    notify(CHANGE_LOOP);
+    out_printf(&t->out, "loop %s\n", loop ? "on" : "off");
+}
+
+// Inserts the file after the current track and plays it. Answers once the
+// track is loaded, see finish_track_load
+void cmd_play(Task* t, char* args) {
+    QueueEntry* entry = insert_entry(current_index() + 1, args);
+    if (!entry) {
+        out_printf(&t->out, "cant load file \"%s\"\n", args);
+        print_status(&t->out);
+        return;
+    }
+    skip_to(entry, t);
+}
+
+void cmd_add(Task* t, char* args) {
+    QueueEntry* entry = insert_entry(queue_len, args);
+    if (!entry) {
+        out_printf(&t->out, "cant add file \"%s\"\n", args);
+        return;
+    }
+    out_printf(&t->out, "added %s\n", entry->name);
+    notify(CHANGE_QUEUE);
+
+    if (current_track) {
+        prepare_next_track();
+    } else if (!find_load(TRACK_START)) {
+        // Nothing to wait for, so start playing right away
+        if (!load_track(entry, TRACK_START, NULL)) printf("cant load file %s\n", entry->path);
+    }
+}
+
+void cmd_next(Task* t, char* args) {
+    (void) args;
+    QueueEntry* entry = next_entry();
+    if (!entry) {
+        out_printf(&t->out, "end of queue\n");
+        return;
+    }
+    skip_to(entry, t);
+}
+
+void cmd_prev(Task* t, char* args) {
+    (void) args;
+    ssize_t i = current_index();
+    if (i <= 0) {
+        out_printf(&t->out, "start of queue\n");
+        return;
+    }
+    skip_to(&queue[i - 1], t);
+}
+
+// The current track keeps playing, it just has nothing after it anymore
+void cmd_clear(Task* t, char* args) {
+    (void) args;
+    flush_render();
+    clear_queue();
+    cancel_loads(TRACK_NEXT);
+    prepare_next_track();
+    notify(CHANGE_QUEUE);
+    out_printf(&t->out, "queue cleared\n");
+}
+
+void cmd_queue(Task* t, char* args) {
+    (void) args;
+    ssize_t current = current_index();
+    for (size_t i = 0; i < queue_len; i++) {
+        out_printf(&t->out, "%c%zu %s\n", (ssize_t)i == current ? '>' : ' ', i + 1, queue[i].name);
+    }
+    if (queue_len == 0) out_printf(&t->out, "queue is empty\n");
+}
+
+void cmd_pitch(Task* t, char* args) {
+    if (args[0] == '\0') {
+        out_printf(&t->out, "pitch %.3f%%\n", pitch);
+        return;
+    }
+
+    float p = atof(args);
+    if (p <= 0.0f || p > 300.0) {
+        out_printf(&t->out, "invalid percent\n");
+        return;
+    }
+    flush_render();
+    pitch = p;
+    apply_settings_to_voices();
+    schedule_crossfade();
+    notify(CHANGE_PITCH);
+    out_printf(&t->out, "pitch %.3f%%\n", p);
+}
+
+void cmd_pause(Task* t, char* args) {
+    (void) args;
+    flush_render();
+    if (!is_playing()) {
+        resume_playback();
+    } else {
+        ma_sound_stop(&voice->sound);
+    }
+    schedule_crossfade();
+    notify(CHANGE_PLAYER);
+    print_status(&t->out);
+}
+
+void cmd_volume(Task* t, char* args) {
+    if (args[0] == '\0') {
+        out_printf(&t->out, "volume %.3f%%\n", volume);
+        return;
+    }
+
+    float v = atof(args);
+    if (v < 0.0f || v > 100.0f) {
+        out_printf(&t->out, "invalid percent\n");
+        return;
+    }
+    flush_render();
+    volume = v;
+    queue_audio_command((AudioCommand) { .type = AUDIO_VOLUME, .value = v / 100.0f });
+    notify(CHANGE_VOLUME);
+    out_printf(&t->out, "volume %.3f%%\n", v);
+}
+
+void cmd_readahead(Task* t, char* args) {
+    (void) args;
+    if (readahead_block == 0) {
+        out_printf(&t->out, "readahead off\n");
+        return;
+    }
+
+    double mib = 1024 * 1024;
+    pthread_mutex_lock(&io_lock);
+    for (VfsFile* f = io_files; f; f = f->next_io) {
+        out_printf(&t->out, "%8.1f/%.1f MiB %s%s\n", buffered_ahead(f) / mib,
+            READAHEAD_BLOCKS * readahead_block / mib, f->path, f->error ? " error" : "");
+    }
+    out_printf(&t->out, "reads %llu, %.1f MiB\n", (unsigned long long)io_reads, io_bytes / mib);
+    out_printf(&t->out, "stalls %llu, %.3f ms, longest %.3f ms\n", (unsigned long long)io_stalls,
+        io_stall_ns / 1e6, io_max_stall_ns / 1e6);
+    pthread_mutex_unlock(&io_lock);
+}
+
+void cmd_cache(Task* t, char* args) {
+    (void) args;
+    size_t pinned = 0;
+    for (CacheEntry* e = cache_head; e; e = e->next) {
+        if (!e->pinned) continue;
+        out_printf(&t->out, "%8.1f MiB %s\n", e->bytes / 1048576.0, e->path);
+        pinned++;
+    }
+    out_printf(&t->out, "cached %zu files, %.1f/%.1f MiB\n", pinned, cache_used / 1048576.0, cache_budget / 1048576.0);
+}
+
+// What the backend granted, and how often the callback actually runs
+void cmd_latency(Task* t, char* args) {
+    (void) args;
+    if (offline) {
+        out_printf(&t->out, "offline, %d frames at %d Hz\n", OFFLINE_PERIOD, OFFLINE_SAMPLE_RATE);
+    } else {
+        ma_uint32 period = output.playback.internalPeriodSizeInFrames;
+        ma_uint32 periods = output.playback.internalPeriods;
+        ma_uint32 rate = output.playback.internalSampleRate;
+        out_printf(&t->out, "%s, %u frames x %u at %u Hz%s\n", ma_get_backend_name(output.pContext->backend),
+            period, periods, rate, output_period ? ", low latency" : "");
+        out_printf(&t->out, "buffer %.3f ms\n", rate ? period * periods * 1000.0 / rate : 0.0);
+    }
+    if (render_running) {
+        out_printf(&t->out, "rendered ahead %.3f/%u ms\n",
+            ma_pcm_rb_available_read(&render_rb) * 1000.0 / ma_engine_get_sample_rate(&audio), deep_buffer);
+    }
+
+    if (suspend_fd != -1) {
+        out_printf(&t->out, "%s, suspended %llu times after %.1f s idle, last resume took %.3f ms, longest %.3f ms\n",
+            suspended ? "suspended" : "running", (unsigned long long)suspends, suspend_after,
+            atomic_load(&resume_ns) / 1e6, atomic_load(&resume_max_ns) / 1e6);
+    }
+
+    uint64_t applied = atomic_load(&applied_commands);
+    if (applied) {
+        out_printf(&t->out, "applied %llu changes, after %.3f ms on average, longest %.3f ms\n",
+            (unsigned long long)applied, atomic_load(&apply_ns) / 1e6 / applied, atomic_load(&apply_max_ns) / 1e6);
+    }
+
+    uint64_t callbacks = atomic_load(&output_callbacks);
+    uint64_t gaps = atomic_load(&output_gaps);
+    if (gaps == 0) {
+        out_printf(&t->out, "no callbacks yet\n");
+        return;
+    }
+    uint64_t frames = atomic_load(&output_frames);
+    double period_ns = (double)atomic_load(&output_gaps_ns) / gaps;
+    out_printf(&t->out, "callbacks %llu, %.1f frames every %.3f ms, longest gap %.3f ms\n",
+        (unsigned long long)callbacks, (double)frames / callbacks, period_ns / 1e6,
+        atomic_load(&output_max_gap_ns) / 1e6);
+    out_printf(&t->out, "speed %.2fx real time\n",
+        (double)frames / callbacks / ma_engine_get_sample_rate(&audio) * 1e9 / period_ns);
+}
+
+// How close mixing runs to the time it has, and how often audio didn't
+// arrive in time. Reset by whoever mixes, like any other change
+void cmd_stats(Task* t, char* args) {
+    if (!strcmp(args, "reset")) {
+        queue_audio_command((AudioCommand) { .type = AUDIO_RESET_STATS });
+        sync_commands();
+        out_printf(&t->out, "stats reset\n");
+        return;
+    }
+    if (args[0] != '\0') {
+        out_printf(&t->out, "invalid argument: %s\n", args);
+        return;
+    }
+
+    uint64_t periods = 0;
+    uint64_t counts[MIX_BUCKETS];
+    for (size_t i = 0; i < MIX_BUCKETS; i++) {
+        counts[i] = atomic_load(&mix_histogram[i]);
+        periods += counts[i];
+    }
+    if (periods == 0) {
+        out_printf(&t->out, "nothing mixed yet\n");
+    } else {
+        uint64_t budget = atomic_load(&mix_budget_ns);
+        out_printf(&t->out, "mixed %llu periods of %.3f ms, took %.3f ms on average (%.1f%%), longest %.3f ms\n",
+            (unsigned long long)periods, budget / 1e6 / periods, atomic_load(&mix_ns) / 1e6 / periods,
+            budget ? atomic_load(&mix_ns) * 100.0 / budget : 0.0, atomic_load(&mix_max_ns) / 1e6);
+        for (size_t i = 0; i < MIX_BUCKETS; i++) {
+            char range[16];
+            if (i < MIX_BUCKETS - 1) {
+                snprintf(range, sizeof(range), "<%u%%", mix_bucket_percent[i]);
+            } else {
+                snprintf(range, sizeof(range), ">=%u%%", mix_bucket_percent[i - 1]);
+            }
+            out_printf(&t->out, "%8s %llu\n", range, (unsigned long long)counts[i]);
+        }
+    }
+
+    uint64_t overruns = atomic_load(&mix_overruns);
+    uint64_t late = atomic_load(&late_callbacks);
+    uint64_t underruns = atomic_load(&render_underruns);
+    out_printf(&t->out, "xruns %llu: %llu periods mixed too slowly, %llu late callbacks, %llu deep buffer underruns\n",
+        (unsigned long long)(overruns + late + underruns), (unsigned long long)overruns,
+        (unsigned long long)late, (unsigned long long)underruns);
+    out_printf(&t->out, "decoder starved %llu times, %llu frames of silence\n",
+        (unsigned long long)atomic_load(&starved_reads), (unsigned long long)atomic_load(&starved_frames));
+}
+
+// Log-linear buckets like HdrHistogram: HIST_SUB_BITS of precision at any
+// magnitude, so nanosecond commands and second long loads share one layout
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+    const char* name;   // Set once the command ran
+    Histogram handled;  // Running the command
+    Histogram answered; // From reading its line to writing out its response
+} CommandStats;
+
+CommandStats command_stats[COMMAND_TABLE_LEN];
+uint64_t command_stats_reset_ns = 0; // Lines read before weren't handled since
+uint64_t commands_run[COMMAND_TABLE_LEN]; // Unlike command_stats never reset
+
+size_t hist_bucket(uint64_t ns) {
+    const uint64_t sub = 1 << HIST_SUB_BITS;
+    if (ns < sub) return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    return ((size_t)(exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (exp - HIST_SUB_BITS)) & (sub - 1));
+}
+
+// Highest value that falls into the bucket
+uint64_t hist_bucket_top(size_t bucket) {
+    const uint64_t sub = 1 << HIST_SUB_BITS;
+    if (bucket < sub) return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    return ((sub + (bucket & (sub - 1)) + 1) << shift) - 1;
+}
+
+void hist_record(Histogram* h, uint64_t ns) {
+    h->buckets[hist_bucket(ns)]++;
+    h->count++;
+    if (ns > h->max) h->max = ns;
+}
+
+uint64_t hist_percentile(const Histogram* h, double percent) {
+    uint64_t rank = ceil(h->count * percent / 100);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return hist_bucket_top(i) < h->max ? hist_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+void format_ns(char* buf, size_t len, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, len, "%llu ns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, len, "%.1f us", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, len, "%.1f ms", ns / 1e6);
+    } else {
+        snprintf(buf, len, "%.2f s", ns / 1e9);
+    }
+}
+
+void print_histogram(Output* out, const char* name, const char* what, const Histogram* h) {
+    const double percents[] = { 50, 90, 99, 99.9 };
+    out_printf(out, "%-11s %-8s %8llu", name, what, (unsigned long long)h->count);
+    char value[32];
+    for (size_t i = 0; i < ARRLEN(percents); i++) {
+        format_ns(value, sizeof(value), hist_percentile(h, percents[i]));
+        out_printf(out, ", p%g %s", percents[i], value);
+    }
+    format_ns(value, sizeof(value), h->max);
+    out_printf(out, ", max %s\n", value);
+}
+
+// Per command, how long running it took and how long the client waited
+// for the answer, from reading its line to writing the response out. The
+// answer of this very command is counted once it's written
+void cmd_cmdstats(Task* t, char* args) {
+    if (!strcmp(args, "reset")) {
+        memset(command_stats, 0, sizeof(command_stats));
+        command_stats_reset_ns = now_ns();
+        out_printf(&t->out, "cmdstats reset\n");
+        return;
+    }
+    if (args[0] != '\0') {
+        out_printf(&t->out, "invalid argument: %s\n", args);
+        return;
+    }
+
+    for (size_t i = 0; i < ARRLEN(command_stats); i++) {
+        CommandStats* c = &command_stats[i];
+        if (!c->name) continue;
+        print_histogram(&t->out, c->name, "handled", &c->handled);
+        if (c->answered.count) print_histogram(&t->out, "", "answered", &c->answered);
+    }
+}
+
+FILE* trace_file = NULL;
+char trace_path[PATH_LEN];
+
+void start_trace(FILE* file, const char* path) {
+    for (unsigned i = 0; i < atomic_load(&trace_threads) && i < TRACE_THREADS; i++) {
+        atomic_store(&trace_rings[i].written, 0);
+    }
+    trace_file = file;
+    strncpy(trace_path, path, PATH_LEN - 1);
+    trace_start_ns = now_ns();
+    atomic_store(&tracing, true);
+}
+
+// Stops tracing and writes out what the rings hold, thread by thread.
+// Blocks the event loop while writing, tracing is for debugging only
+void finish_trace(Output* out) {
+    atomic_store(&tracing, false);
+    unsigned threads = atomic_load(&trace_threads);
+    if (threads > TRACE_THREADS) threads = TRACE_THREADS;
+
+    uint64_t events = 0;
+    uint64_t dropped = 0;
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (unsigned i = 0; i < threads; i++) {
+        TraceRing* r = &trace_rings[i];
+        while (atomic_load(&r->writing));
+        uint64_t written = atomic_load_explicit(&r->written, memory_order_acquire);
+        if (written == 0) continue;
+
+        fprintf(trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            events ? ",\n" : "", i + 1, r->thread);
+        uint64_t first = written > TRACE_RING_LEN ? written - TRACE_RING_LEN : 0;
+        for (uint64_t n = first; n < written; n++) {
+            TraceEvent* e = &r->events[n % TRACE_RING_LEN];
+            fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                e->name, e->cat, i + 1, (e->start_ns - trace_start_ns) / 1e3, e->dur_ns / 1e3);
+        }
+        events += written - first;
+        dropped += first;
+    }
+    fprintf(trace_file, "\n]}\n");
+
+    bool failed = ferror(trace_file);
+    if (fclose(trace_file) != 0) failed = true;
+    trace_file = NULL;
+    if (failed) {
+        printf("Cannot write trace %s\n" SUB("Nothing to see here"), trace_path);
+        if (out) out_printf(out, "cannot write %s\n", trace_path);
+    } else {
+        printf("Trace written to %s\n", trace_path);
+        if (out) {
+            out_printf(out, "trace written to %s, %llu spans, %llu dropped\n", trace_path,
+                (unsigned long long)events, (unsigned long long)dropped);
+        }
+    }
+}
+
+// Opens chrome://tracing or ui.perfetto.dev, with a track per thread
+void cmd_trace(Task* t, char* args) {
+    char* path = cut_and_get_next_word(args);
+    if (!strcmp(args, "start") && *path) {
+        if (trace_file) {
+            out_printf(&t->out, "already tracing to %s\n", trace_path);
+            return;
+        }
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            out_printf(&t->out, "cannot open %s: %s\n", path, strerror(errno));
+            return;
+        }
+        start_trace(file, path);
+        out_printf(&t->out, "tracing to %s\n", path);
+    } else if (!strcmp(args, "stop") && !*path) {
+        if (!trace_file) {
+            out_printf(&t->out, "not tracing\n");
+            return;
+        }
+        finish_trace(&t->out);
+    } else if (!*args) {
+        if (trace_file) {
+            out_printf(&t->out, "tracing to %s\n", trace_path);
+        } else {
+            out_printf(&t->out, "not tracing\n");
+        }
+    } else {
+        out_printf(&t->out, "usage: trace [start <file> | stop]\n");
+    }
+}
+
+// Takes effect from the next track on, which is handed to the audio thread
+// again to switch between chaining and crossfading
+void cmd_crossfade(Task* t, char* args) {
+    if (args[0] == '\0') {
+        out_printf(&t->out, "crossfade %.3f\n", crossfade);
+        return;
+    }
+
+    float c = atof(args);
+    if (c < 0.0f || c > CROSSFADE_MAX) {
+        out_printf(&t->out, "invalid time\n");
+        return;
+    }
+    flush_render();
+    crossfade = c;
+    Track* track = unchain_next_track();
+    if (track) chain_next_track(track);
+    out_printf(&t->out, "crossfade %.3f\n", c);
+}
+
+void cmd_help(Task* t, char* args) {
+    (void) args;
+    out_printf(&t->out,
+        "Usage: <command> [args]\n"
+        "Commands:\n"
+        "    status                   -- Show current status\n"
+        "    quit                     -- Quit\n"
+        "    time                     -- Show raw time and length\n"
+        "    seek                     -- (Re)start music\n"
+        "    seek <seconds>           -- Seek to specified position\n"
+        "    play <music_file_path>   -- Play a file right after the current track\n"
+        "    add <music_file_path>    -- Add a file to the end of the queue\n"
+        "    next                     -- Skip to the next track\n"
+        "    prev                     -- Go back to the previous track\n"
+        "    queue                    -- Show the queue\n"
+        "    clear                    -- Empty the queue\n"
+        "    loop                     -- Toggle looping\n"
+        "    pause                    -- Toggle pause\n"
+        "    volume                   -- Show volume\n"
+        "    volume <percent>         -- Set volume\n"
+        "    pitch                    -- Show pitch\n"
+        "    pitch <percent>          -- Set pitch\n"
+        "    crossfade                -- Show crossfade length\n"
+        "    crossfade <seconds>      -- Fade between tracks, 0 to play them gapless\n"
+        "    cache                    -- Show files kept decoded in memory\n"
+        "    readahead                -- Show how much of the open files is read ahead\n"
+        "    latency                  -- Show the output buffer and callback timing\n"
+        "    stats                    -- Show mixing time, xruns and decoder starvation\n"
+        "    stats reset              -- Start counting them again\n"
+        "    cmdstats                 -- Show how long each command takes to run and answer\n"
+        "    cmdstats reset           -- Start timing them again\n"
+        "    trace start <file>       -- Record what every thread is doing\n"
+        "    trace stop               -- Write the recording out as a Chrome trace\n"
+        "    idle [subsystems]        -- Wait until one of subsystems changes\n"
+        "    noidle                   -- Stop waiting\n"
+        "    subscribe [subsystems]   -- Get notified about every change of subsystems\n"
+        "    unsubscribe [subsystems] -- Stop getting notified\n"
+        "Subsystems: player track volume pitch loop queue (all if none given)\n");
+}
+
+void cmd_idle(Task* t, char* args) {
+    unsigned changes = parse_changes(args, &t->out);
+    if (!changes) return;
+    t->idle_mask = changes;
+    watch(t);
+}
+
+void cmd_noidle(Task* t, char* args) {
+    (void) args;
+    t->idle_mask = 0;
+    if (!t->sub_mask) unwatch(t);
+}
+
+void cmd_subscribe(Task* t, char* args) {
+    unsigned changes = parse_changes(args, &t->out);
+    if (!changes) return;
+    t->sub_mask |= changes;
+    watch(t);
+    out_printf(&t->out, "subscribed\n");
+}
+
+void cmd_unsubscribe(Task* t, char* args) {
+    unsigned changes = parse_changes(args, &t->out);
+    if (!changes) return;
+    t->sub_mask &= ~changes;
+    if (!t->sub_mask && !t->idle_mask) unwatch(t);
+    out_printf(&t->out, "unsubscribed\n");
+}
+
+void cmd_quit(Task* t, char* args) {
+    (void) args;
+    out_printf(&t->out, "Exiting...\n");
+    printf("Exit command received, exiting...\n");
+    is_running = false;
+}
+
+const Command commands[] = {
+    { "status",      cmd_status,      ARGS_NONE,       "status" },
+    { "time",        cmd_time,        ARGS_NONE,       "time" },
+    { "seek",        cmd_seek,        ARGS_NUMBER_OPT, "seek [seconds]" },
+    { "loop",        cmd_loop,        ARGS_NONE,       "loop" },
+    { "play",        cmd_play,        ARGS_STRING,     "play <music_file_path>" },
+    { "add",         cmd_add,         ARGS_STRING,     "add <music_file_path>" },
+    { "next",        cmd_next,        ARGS_NONE,       "next" },
+    { "prev",        cmd_prev,        ARGS_NONE,       "prev" },
+    { "queue",       cmd_queue,       ARGS_NONE,       "queue" },
+    { "clear",       cmd_clear,       ARGS_NONE,       "clear" },
+    { "pitch",       cmd_pitch,       ARGS_NUMBER_OPT, "pitch [percent]" },
+    { "pause",       cmd_pause,       ARGS_NONE,       "pause" },
+    { "volume",      cmd_volume,      ARGS_NUMBER_OPT, "volume [percent]" },
+    { "crossfade",   cmd_crossfade,   ARGS_NUMBER_OPT, "crossfade [seconds]" },
+    { "cache",       cmd_cache,       ARGS_NONE,       "cache" },
+    { "readahead",   cmd_readahead,   ARGS_NONE,       "readahead" },
+    { "latency",     cmd_latency,     ARGS_NONE,       "latency" },
+    { "stats",       cmd_stats,       ARGS_WORDS,      "stats [reset]" },
+    { "cmdstats",    cmd_cmdstats,    ARGS_WORDS,      "cmdstats [reset]" },
+    { "trace",       cmd_trace,       ARGS_WORDS,      "trace [start <file> | stop]" },
+    { "help",        cmd_help,        ARGS_NONE,       "help" },
+    { "idle",        cmd_idle,        ARGS_WORDS,      "idle [subsystems]" },
+    { "noidle",      cmd_noidle,      ARGS_NONE,       "noidle" },
+    { "subscribe",   cmd_subscribe,   ARGS_WORDS,      "subscribe [subsystems]" },
+    { "unsubscribe", cmd_unsubscribe, ARGS_WORDS,      "unsubscribe [subsystems]" },
+    { "quit",        cmd_quit,        ARGS_NONE,       "quit" },
+};
+
+// Perfect hash of command names. The seed is searched for at startup, so
+// every command gets its own slot and a lookup is one hash and one strcmp
+// no matter how many commands there are
+const Command* command_table[COMMAND_TABLE_LEN];
+uint32_t command_seed = 0;
+
+uint32_t hash_command(const char* name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return (hash ^ (hash >> 15)) % COMMAND_TABLE_LEN;
+}
+
+void build_command_table(void) {
+    _Static_assert(ARRLEN(commands) <= COMMAND_TABLE_LEN, "Command table is too small");
+
+    for (command_seed = 0; command_seed < 100000; command_seed++) {
+        memset(command_table, 0, sizeof(command_table));
+
+        size_t i;
+        for (i = 0; i < ARRLEN(commands); i++) {
+            uint32_t slot = hash_command(commands[i].name, command_seed);
+            if (command_table[slot]) break;
+            command_table[slot] = &commands[i];
+        }
+        if (i == ARRLEN(commands)) return;
+    }
+    ball("Cannot build command table\n" SUB("Make COMMAND_TABLE_LEN bigger"));
+}
+
+const Command* find_command(const char* name) {
+    const Command* cmd = command_table[hash_command(name, command_seed)];
+    if (!cmd || strcmp(cmd->name, name)) return NULL;
+    return cmd;
+}
+
+bool is_number(const char* str) {
+    char* end;
+    strtof(str, &end);
+    if (end == str) return false;
+    while (*end == ' ') end++;
+    return *end == '\0';
+}
+
+// Remembers the command until its response is written out. If that can't
+// be remembered, it only goes without its answered time
+void add_timed_command(Task* t, size_t command) {
+    if (t->timed_len == t->timed_cap) {
+        size_t new_cap = t->timed_cap ? t->timed_cap * 2 : 16;
+        TimedCommand* new_timed = realloc(t->timed, new_cap * sizeof(TimedCommand));
+        if (!new_timed) return;
+        t->timed = new_timed;
+        t->timed_cap = new_cap;
+    }
+    t->timed[t->timed_len++] = (TimedCommand) {
+        .command = command,
+        .done = !t->waiting,
+        .read_ns = t->read_ns,
+    };
+}
+
+// Called once all of a task's output is written out, which answers every
+// command run for it except one it still waits for
+void record_answered(Task* t) {
+    uint64_t now = now_ns();
+    size_t i = 0;
+    for (; i < t->timed_len && t->timed[i].done; i++) {
+        if (t->timed[i].read_ns < command_stats_reset_ns) continue;
+        hist_record(&command_stats[t->timed[i].command].answered, now - t->timed[i].read_ns);
+    }
+    if (i == 0) return;
+    t->timed_len -= i;
+    memmove(t->timed, t->timed + i, t->timed_len * sizeof(TimedCommand));
+}
+
+void process_commands(char* command, Task* t) {
+    uint64_t start = now_ns();
+    char* args = cut_and_get_next_word(command);
+
+    const Command* cmd = find_command(command);
+    if (!cmd) {
+        out_printf(&t->out, "invalid command: %s\n", command);
+        return;
+    }
+
+    bool valid;
+    switch (cmd->args) {
+    case ARGS_NONE:       valid = args[0] == '\0'; break;
+    case ARGS_NUMBER_OPT: valid = args[0] == '\0' || is_number(args); break;
+    case ARGS_STRING:     valid = args[0] != '\0'; break;
+    case ARGS_WORDS:      valid = true; break;
+    default:              valid = false; break;
+    }
+    if (!valid) {
+        out_printf(&t->out, "usage: %s\n", cmd->usage);
+        return;
+    }
+
+    cmd->func(t, args);
+
+    uint64_t end = now_ns();
+    trace_span("command", cmd->name, start, end);
+    size_t index = cmd - commands;
+    command_stats[index].name = cmd->name;
+    commands_run[index]++;
+    hist_record(&command_stats[index].handled, end - start);
+    add_timed_command(t, index);
+}
+
+// Reads everything available on the task's fd into its input buffer, stopping
+// early only when the buffer reaches INPUT_MAX_LEN. Returns like read() does,
+// except that hitting EAGAIN after some data was read is not an error.
+// EOF is reported through in_eof so the data read before it is not lost
+ssize_t read_input(Task* t) {
+    ssize_t total = 0;
+
+    while (t->in_len < INPUT_MAX_LEN - 1) {
+        if (t->in_cap - t->in_len < INPUT_READ_LEN) {
+            size_t new_cap = t->in_cap ? t->in_cap * 2 : INPUT_READ_LEN * 2;
+            if (new_cap > INPUT_MAX_LEN) new_cap = INPUT_MAX_LEN;
+            if (new_cap > t->in_cap) {
+                char* new_buf = realloc(t->in_buf, new_cap);
+                if (!new_buf) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                t->in_buf = new_buf;
+                t->in_cap = new_cap;
+            }
+        }
+
+        // Always leave space for the terminator of the last line
+        ssize_t len = read(t->fd, t->in_buf + t->in_len, t->in_cap - t->in_len - 1);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && total > 0) break;
+            return -1;
+        }
+        if (len == 0) {
+            t->in_eof = true;
+            break;
+        }
+        t->in_len += len;
+        total += len;
+    }
+    bytes_received += total;
+
+    if (total > 0) t->read_ns = now_ns();
+    return total;
+}
+
+void run_line(char* line, Task* t) {
+    while (*line == ' ' || *line == '\r') line++;
+    if (*line == '\0') return;
+
+    char* end = line + strlen(line);
+    while (end > line && end[-1] == '\r') *--end = '\0';
+    process_commands(line, t);
+}
+
+void flush_task(Task* t);
+
+// Runs every complete line in the input buffer in order and keeps the
+// unfinished tail for the next read. On EOF the tail is run as well, since
+// nothing is going to complete it anymore. Once half of the output limit is
+// queued the output is flushed, and if the client isn't reading it the
+// remaining lines wait until it does.
+// Returns false if a single line does not fit into the buffer
+bool run_input_lines(Task* t) {
+    char* line = t->in_buf;
+    char* end = t->in_buf + t->in_len;
+    char* newline;
+    bool paused = false;
+
+    while (is_running && (newline = memchr(line, '\n', end - line))) {
+        if (t->waiting) {
+            paused = true;
+            break;
+        }
+        if (t->out.queued >= out_high_water / 2) {
+            flush_task(t);
+            if (t->write_blocked || t->delete) {
+                paused = true;
+                break;
+            }
+        }
+        *newline = '\0';
+        run_line(line, t);
+        line = newline + 1;
+    }
+
+    if (t->in_eof && !paused && !t->waiting && is_running && line < end) {
+        *end = '\0';
+        run_line(line, t);
+        line = end;
+    }
+
+    // Lines are only ever consumed, so line never passes end
+    size_t consumed = line - t->in_buf;
+    t->in_len = consumed < t->in_len ? t->in_len - consumed : 0;
+    if (t->in_len > 0) memmove(t->in_buf, t->in_buf + consumed, t->in_len);
+    return paused || t->in_len < INPUT_MAX_LEN - 1;
+}
+
+// Output is not written right away but once per event loop iteration, so
+// everything queued for a task in the meantime goes out in one writev
+void schedule_flush(Task* t) {
+    if (t->flush_scheduled) return;
+    t->flush_scheduled = true;
+    t->next_flush = flush_list;
+    flush_list = t;
+}
+
+void flush_scheduled_tasks(void) {
+    while (flush_list) {
+        Task* t = flush_list;
+        flush_list = t->next_flush;
+        t->flush_scheduled = false;
+        if (!t->delete) flush_task(t);
+    }
+}
+
+// A task that is waiting for its output to drain only listens for EPOLLOUT.
+// One that waits for a command to finish doesn't listen at all, the command
+// resumes it when done
+void update_task_events(Task* t) {
+    uint32_t events = t->events;
+    if (t->write_blocked) {
+        events = EPOLLOUT;
+    } else if (t->waiting) {
+        events = 0;
+    }
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = t,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, t->fd, &ev) == -1) {
+        printf("Cannot change task events: %s\n" SUB("Epoll said no"), strerror(errno));
+        delete_task(t->fd);
+    }
+}
 
-        char* argpos = args;
-        while (*argpos != '\0' && *argpos != '\n') argpos++;
-        *argpos = '\0';
+// Writes out the task's pending output. While the socket is full the task
+// waits for EPOLLOUT and stops running commands. If the output still grows
+// past out_high_water (e.g. with pushed events) the client is evicted, so a
+// stuck client can't hold memory or delay anyone else
+void flush_task(Task* t) {
+    // Responses to stdin go straight to fd 1, so the log printed so far has to be out first
+    if (t->out.fd == STDOUT_FILENO) fflush(stdout);
 
-        if (ma_sound_init_from_file(&audio, args, MA_SOUND_FLAG_STREAM, NULL, NULL, &sound)) {
-            fprintf(f, "cant load file \"%s\"\n", args);
-            print_status(f);
-            return;
+    int ret = flush_output(&t->out);
+    if (ret == -1) {
+        if (errno != EPIPE && errno != ECONNRESET) {
+            printf("Cannot write socket: %s\n" SUB("Writing is forbidden by PKN"), strerror(errno));
         }
-        ma_sound_set_looping(&sound, loop);
-        ma_sound_set_volume(&sound, volume / 100.0f);
-        ma_sound_set_pitch(&sound, pitch / 100.0f);
-        strncpy(running_filepath, basename(args), PATH_LEN - 1);
+        delete_task(t->fd);
+        return;
+    }
 
-        ma_sound_start(&sound);
-        fprintf(f, "Playing %s\n", running_filepath);
+    if (ret == 1) record_answered(t);
 
-        return;
-    } else if (!strcmp(command, "pitch")) {
-        if (args[0] == '\0') {
-            fprintf(f, "pitch %.3f%%\n", pitch);
-            return;
-        }
+    // Output of stdin goes to a different fd, which is retried on the next flush
+    if (t->out.fd != t->fd) return;
 
-        float p = atof(args);
-        if (p <= 0.0f || p > 300.0) {
-            fprintf(f, "invalid percent\n");
-            return;
-        }
-        pitch = p;
-        ma_sound_set_pitch(&sound, p / 100.0f);
-        fprintf(f, "pitch %.3f%%\n", p);
+    if (ret == 0 && t->out.queued > out_high_water) {
+        printf("Client has %zu bytes of unread output, evicting it\n" SUB("Read your messages"), t->out.queued);
+        delete_task(t->fd);
         return;
-    } else if (!strcmp(command, "pause")) {
-        if (!ma_sound_is_playing(&sound)) {
-            ma_sound_start(&sound);
-        } else {
-            ma_sound_stop(&sound);
-        }
-        print_status(f);
-        return;
-    } else if (!strcmp(command, "volume")) {
-        if (args[0] == '\0') {
-            fprintf(f, "volume %.3f%%\n", volume);
-            return;
-        }
+    }
 
-        float v = atof(args);
-        if (v < 0.0f || v > 100.0f) {
-            fprintf(f, "invalid percent\n");
-            return;
-        }
-        volume = v;
-        ma_sound_set_volume(&sound, v / 100.0f);
-        fprintf(f, "volume %.3f%%\n", v);
+    // Client hung up and got all its responses
+    if (ret == 1 && t->in_eof && t->in_len == 0 && !t->waiting) {
+        delete_task(t->fd);
         return;
-    } else if (!strcmp(command, "help")) {
-        fprintf(f,
-            "Usage: <command> [args]\n"
-            "Commands:\n"
-            "    status                 -- Show current status\n"
-            "    quit                   -- Quit\n"
-            "    time                   -- Show raw time and length\n"
-            "    seek                   -- (Re)start music\n"
-            "    seek <seconds>         -- Seek to specified position\n"
-            "    play <music_file_path> -- Open a different music file\n"
-            "    loop                   -- Toggle looping\n"
-            "    pause                  -- Toggle pause\n"
-            "    volume                 -- Show volume\n"
-            "    volume <percent>       -- Set volume\n"
-            "    pitch                  -- Show pitch\n"
-            "    pitch <percent>        -- Set pitch\n");
-        return;
-    } else if (!strcmp(command, "quit")) {
-        fprintf(f, "Exiting...\n");
-        printf("Exit command received, exiting...\n");
-        is_running = false;
+    }
+
+    bool write_blocked = ret == 0;
+    if (write_blocked == t->write_blocked) return;
+    t->write_blocked = write_blocked;
+    update_task_events(t);
+}
+
+void run_client_input(Task* t) {
+    bool was_waiting = t->waiting;
+    if (!run_input_lines(t)) {
+        printf("Client sent a line longer than %d bytes, disconnecting\n" SUB("Keep it short"), INPUT_MAX_LEN);
+        delete_task(t->fd);
         return;
     }
+    if (t->waiting != was_waiting) update_task_events(t);
+    schedule_flush(t);
+}
 
-    fprintf(f, "invalid command: %s\n", command);
+// Runs the commands that came in while the task was waiting
+void resume_task(Task* t) {
+    if (!t->waiting) return;
+    t->waiting = false;
+    // Lines stop running after the one that waits, so it's the last
+    if (t->timed_len) t->timed[t->timed_len - 1].done = true;
+    update_task_events(t);
+    if (!t->delete) run_client_input(t);
 }
 
 int serve_client(int client) {
-    char inp_buf[256];
+    Task* t = get_task(client);
 
-    int len = read(client, inp_buf, sizeof(inp_buf) - 1);
-    if (len == -1) {
+    if (read_input(t) == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
         printf("Cannot read socket: %s\n" SUB("Reading is forbidden by PKN"), strerror(errno));
         delete_task(client);
         return 1;
     }
-    if (len == 0) {
-        delete_task(client);
-        return 1;
-    }
-    inp_buf[len] = '\0';
-
-    FILE* f = fdopen(dup(client), "w");
-    char* command = inp_buf;
-    while (*command == ' ' || *command == '\n') command++;
-    process_commands(command, f);
-    fclose(f);
 
+    run_client_input(t);
     return 1;
 }
 
-int accept_connection(int sock) {
+int accept_task(int sock, TaskFunc serve) {
     int client = accept(sock, NULL, NULL);
     if (client == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
@@ -267,63 +3446,221 @@ int accept_connection(int sock) {
         return 1;
     }
 
-    if (!new_task(client, serve_client)) return -1;
+    if (!new_task(client, EPOLLIN, serve)) {
+        close(client);
+        return 1;
+    }
+    if (serve == serve_client) clients++;
 
     return 0;
 }
 
+int accept_connection(int sock) {
+    return accept_task(sock, serve_client);
+}
+
 int serve_stdin(int fd) {
-    char inp_buf[256];
+    Task* t = get_task(fd);
 
-    int len = read(fd, inp_buf, sizeof(inp_buf) - 1);
-    if (len == -1) {
+    if (read_input(t) == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
         printf("Cannot read stdin: %s\n" SUB("Reading is forbidden by PKN"), strerror(errno));
         delete_task(fd);
         return 1;
     }
-    if (len == 0) {
+
+    if (!run_input_lines(t)) {
+        printf("Line is longer than %d bytes, dropping it\n", INPUT_MAX_LEN);
+        t->in_len = 0;
+    }
+    flush_task(t);
+
+    if (t->in_eof) {
         printf("Got EOF, nuking stdin from this program\n" SUB("You should not have done this..."));
         delete_task(fd);
+    }
+
+    return 1;
+}
+
+// With --metrics, putin-metrics.sock answers every connection with the
+// counters below in the Prometheus text format and hangs up. Everything
+// is counted as it happens, so a scrape only reads numbers and never
+// waits for the audio thread
+
+void print_metric(Output* out, const char* name, const char* type, const char* help, double value) {
+    out_printf(out, "# HELP putin_%s %s\n# TYPE putin_%s %s\nputin_%s %.15g\n", name, help, name, type, name, value);
+}
+
+// Resident memory, 0 where /proc can't tell
+uint64_t resident_bytes(void) {
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+    unsigned long long size = 0, resident = 0;
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2) resident = 0;
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void print_metrics(Output* out) {
+    print_metric(out, "clients", "gauge", "Connected clients", clients);
+    print_metric(out, "received_bytes_total", "counter", "Bytes read from clients", bytes_received);
+    print_metric(out, "sent_bytes_total", "counter", "Bytes written to clients", bytes_sent);
+
+    out_printf(out, "# HELP putin_commands_total Commands run\n# TYPE putin_commands_total counter\n");
+    for (size_t i = 0; i < ARRLEN(commands); i++) {
+        out_printf(out, "putin_commands_total{command=\"%s\"} %llu\n", commands[i].name,
+            (unsigned long long)commands_run[i]);
+    }
+
+    print_metric(out, "playing", "gauge", "Whether a track is playing",
+        is_playing());
+    print_metric(out, "suspended", "gauge", "Whether the audio device is stopped to save power", suspended);
+    print_metric(out, "output_callbacks_total", "counter", "Audio callbacks", atomic_load(&output_callbacks));
+    print_metric(out, "output_frames_total", "counter", "Frames played", atomic_load(&output_frames));
+    print_metric(out, "decoded_frames_total", "counter", "Frames read from the decoders", atomic_load(&decoded_frames));
+
+    // Cleared by `stats reset`
+    uint64_t periods = 0;
+    for (size_t i = 0; i < MIX_BUCKETS; i++) periods += atomic_load(&mix_histogram[i]);
+    print_metric(out, "mix_periods_total", "counter", "Periods mixed", periods);
+    print_metric(out, "mix_seconds_total", "counter", "Time spent mixing", atomic_load(&mix_ns) / 1e9);
+    print_metric(out, "mix_budget_seconds_total", "counter", "Time the mixed periods play",
+        atomic_load(&mix_budget_ns) / 1e9);
+    out_printf(out, "# HELP putin_xruns_total Audio that didn't arrive in time, see the stats command\n"
+        "# TYPE putin_xruns_total counter\n");
+    out_printf(out, "putin_xruns_total{kind=\"overrun\"} %llu\n", (unsigned long long)atomic_load(&mix_overruns));
+    out_printf(out, "putin_xruns_total{kind=\"late\"} %llu\n", (unsigned long long)atomic_load(&late_callbacks));
+    out_printf(out, "putin_xruns_total{kind=\"underrun\"} %llu\n", (unsigned long long)atomic_load(&render_underruns));
+    print_metric(out, "starved_reads_total", "counter", "Reads the decoder had nothing ready for",
+        atomic_load(&starved_reads));
+    print_metric(out, "starved_frames_total", "counter", "Frames played as silence while the decoder wasn't ready",
+        atomic_load(&starved_frames));
+
+    ma_uint32 rate = ma_engine_get_sample_rate(&audio);
+    if (render_running) {
+        print_metric(out, "render_buffer_seconds", "gauge", "Audio rendered ahead with --deep-buffer",
+            (double)ma_pcm_rb_available_read(&render_rb) / rate);
+        print_metric(out, "render_buffer_capacity_seconds", "gauge", "Size of the deep buffer", deep_buffer / 1e3);
+    }
+    print_metric(out, "audio_commands_queued", "gauge", "Changes waiting for the audio thread",
+        atomic_load(&audio_ring_write) - atomic_load(&audio_ring_read));
+
+    print_metric(out, "cache_hits_total", "counter", "Tracks played from a decoded copy in memory", cache_hits);
+    print_metric(out, "cache_misses_total", "counter", "Tracks that had to be decoded", cache_misses);
+    print_metric(out, "cache_used_bytes", "gauge", "Memory held by decoded copies", cache_used);
+    print_metric(out, "cache_budget_bytes", "gauge", "Memory allowed for decoded copies", cache_budget);
+    print_metric(out, "resident_bytes", "gauge", "Resident memory", resident_bytes());
+}
+
+// Waits for the end of the request, a blank line, so HTTP clients like
+// curl --unix-socket and anything that sends an empty line both work
+int serve_metrics(int fd) {
+    Task* t = get_task(fd);
+    // Answered already, gone once it's written out
+    if (t->in_eof) return 1;
+
+    if (read_input(t) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+        delete_task(fd);
         return 1;
     }
-    inp_buf[len] = '\0';
 
-    char* command = inp_buf;
-    while (*command == ' ' || *command == '\n') command++;
-    process_commands(command, stdout);
+    t->in_buf[t->in_len] = '\0';
+    if (!t->in_eof && !strstr(t->in_buf, "\n\r\n") && !strstr(t->in_buf, "\n\n")) {
+        if (t->in_len >= INPUT_MAX_LEN - 1) delete_task(fd);
+        return 1;
+    }
 
+    out_printf(&t->out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    print_metrics(&t->out);
+    // flush_task hangs up on a client that is done once everything is written
+    t->in_eof = true;
+    t->in_len = 0;
+    schedule_flush(t);
     return 1;
 }
 
-bool run_server(void) {
-    if (fcntl(0, F_SETFL, O_NONBLOCK) == -1) {
-        printf("Failed to set file descriptor flags: %s\n" SUB("This was a bad idea"), strerror(errno));
-        return false;
+int accept_metrics(int sock) {
+    return accept_task(sock, serve_metrics);
+}
+
+ma_result start_output(void);
+ma_result stop_output(void);
+
+// Nothing is mixed while the device is stopped, so it is once nothing has
+// played for suspend_after seconds, and started again by the event loop
+// round that starts playback
+int serve_suspend_timer(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+        printf("Cannot read timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+    suspend_armed = false;
+    if (is_playing()) return 1;
+    if (stop_output() == MA_SUCCESS) {
+        suspended = true;
+        suspends++;
     }
+    return 1;
+}
 
-    umask(0);
+void set_suspend_timer(float seconds) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = (time_t)seconds;
+    spec.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+    timerfd_settime(suspend_fd, 0, &spec, NULL);
+    suspend_armed = seconds > 0.0f;
+}
+
+void resume_output(void) {
+    atomic_store(&resume_asked_ns, now_ns());
+    if (start_output() != MA_SUCCESS) {
+        atomic_store(&resume_asked_ns, 0);
+        printf("Cannot restart audio device\n" SUB("Have you tried turning it off and on again?"));
+    }
+    suspended = false;
+    wake_render();
+}
+
+// Called once per event loop round, after the commands
+void update_suspend(void) {
+    // Rendering offline stops for every round, and waits for loads too, so
+    // tracks follow each other the same way on every run
+    if (offline) {
+        if (is_playing() && !loading_tracks) start_output();
+        return;
+    }
+    if (suspend_fd == -1) return;
+    if (is_playing()) {
+        if (suspended) resume_output();
+        if (suspend_armed) set_suspend_timer(0.0f);
+    } else if (!suspended && !suspend_armed) {
+        set_suspend_timer(suspend_after);
+    }
+}
 
+// Returns the listening socket in the runtime directory, or -1
+int listen_socket(const char* name) {
     int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sock == -1) {
         printf("Cannot create socket: %s\n" SUB("Your GNU is not unix"), strerror(errno));
-        return false;
+        return -1;
     }
 
     char sock_path[108];
-
-    char* runtime_dir = getenv("XDG_RUNTIME_DIR");
-    char* next = stpncpy(sock_path, runtime_dir ? runtime_dir : ".", sizeof(sock_path));
-    if (sizeof(sock_path) - (next - sock_path) < sizeof("/putin.sock")) {
-        printf("Size of environment variable is too large\n");
-        return false;
+    if (!runtime_path(sock_path, sizeof(sock_path), name)) {
+        close(sock);
+        return -1;
     }
-    stpncpy(next, "/putin.sock", sizeof(sock_path) - (next - sock_path));
-    
+
     if (unlink(sock_path) == -1) {
         if (errno != ENOENT) {
             printf("Cannot remove socket: %s\n", strerror(errno));
-            return false;
+            close(sock);
+            return -1;
         }
     }
 
@@ -332,83 +3669,664 @@ bool run_server(void) {
     strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path));
     if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
         printf("Cannot bind socket: %s\n" SUB("Not bing - bind!"), strerror(errno));
-        return false;
+        close(sock);
+        return -1;
     }
 
     if (listen(sock, 10) == -1) {
         printf("Cannot listen on socket: %s\n" SUB("I can't hear, i'm a DELTARUNE fan!"), strerror(errno));
-        return false;
+        close(sock);
+        return -1;
     }
     printf("Listening on socket: %s\n", sock_path);
 
     if (fchmod(sock, 777) == -1) {
         printf("Cannot change permissions: %s\n" SUB("Permission denied"), strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Names the spans of tasks in a trace
+const char* task_name(TaskFunc func) {
+    if (func == serve_client) return "client";
+    if (func == serve_stdin) return "stdin";
+    if (func == accept_connection) return "accept";
+    if (func == serve_changes) return "audio changes";
+    if (func == serve_suspend_timer) return "suspend timer";
+    if (func == serve_metrics) return "metrics";
+    if (func == accept_metrics) return "accept metrics";
+    return "task";
+}
+
+bool run_server(void) {
+    if (fcntl(0, F_SETFL, O_NONBLOCK) == -1) {
+        printf("Failed to set file descriptor flags: %s\n" SUB("This was a bad idea"), strerror(errno));
         return false;
     }
+    trace_thread_name = "event loop";
 
-    new_task(sock, accept_connection);
-    new_task(0, serve_stdin);
+    umask(0);
 
-    fd_set fds;
-    bool success = true;
+    int sock = listen_socket("putin.sock");
+    if (sock == -1) return false;
 
-    while (is_running) {
-        int max_fd = 0;
-        FD_ZERO(&fds);
-        for (int i = 0; i < task_list_len; i++) {
-            if (task_list[i].fd > max_fd) max_fd = task_list[i].fd;
-            FD_SET(task_list[i].fd, &fds);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        printf("Cannot create epoll instance: %s\n" SUB("Select was fine anyway"), strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    if (!new_task(sock, EPOLLIN | EPOLLET, accept_connection)) {
+        close(sock);
+        close(epoll_fd);
+        return false;
+    }
+    // Regular files and /dev/null can't be polled, so stdin is just not served then
+    if (new_task(0, EPOLLIN, serve_stdin)) {
+        get_task(0)->out.fd = STDOUT_FILENO;
+    } else {
+        printf("Not reading commands from stdin\n");
+    }
+
+    change_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (change_fd == -1 || !new_task(change_fd, EPOLLIN, serve_changes)) {
+        printf("Cannot create eventfd: %s\n" SUB("Nobody will know what happened"), strerror(errno));
+        if (change_fd != -1) close(change_fd);
+        change_fd = -1;
+        free_task_table();
+        close(epoll_fd);
+        return false;
+    }
+    // Tracks may have finished loading before there was anyone to tell
+    wake_event_loop();
+
+    if (metrics) {
+        int metrics_sock = listen_socket("putin-metrics.sock");
+        if (metrics_sock == -1 || !new_task(metrics_sock, EPOLLIN | EPOLLET, accept_metrics)) {
+            printf("Not serving metrics\n");
+            if (metrics_sock != -1) close(metrics_sock);
         }
+    }
+
+    if (suspend_after > 0.0f && !offline) {
+        suspend_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (suspend_fd == -1 || !new_task(suspend_fd, EPOLLIN, serve_suspend_timer)) {
+            printf("Cannot create timerfd, the audio device keeps running: %s\n", strerror(errno));
+            if (suspend_fd != -1) close(suspend_fd);
+            suspend_fd = -1;
+        }
+    }
+
+    if (!prealloc_chunks(OUT_CHUNK_PREALLOC)) {
+        printf("Cannot allocate output buffers\n" SUB("Download more RAM"));
+        free_task_table();
+        close(epoll_fd);
+        return false;
+    }
+
+    char page_path[PATH_LEN];
+    if (runtime_path(page_path, sizeof(page_path), "putin.status")) open_status_page(page_path);
 
-        if (select(max_fd + 1, &fds, NULL, NULL, NULL) == -1) {
-            printf("Failed to select: %s\n", strerror(errno));
+    struct epoll_event events[EVENT_LIST_LEN];
+    bool success = true;
+
+    while (is_running) {
+        int events_len = epoll_wait(epoll_fd, events, EVENT_LIST_LEN, -1);
+        if (events_len == -1) {
+            if (errno == EINTR) continue;
+            printf("Failed to wait for events: %s\n", strerror(errno));
             break;
         }
-        
-        for (int i = 0; i < task_list_len; i++) {
-            if (!FD_ISSET(task_list[i].fd, &fds)) continue;
+        if (offline) stop_output();
+
+        for (int i = 0; i < events_len; i++) {
+            Task* t = events[i].data.ptr;
+            if (t->delete) continue;
+
+            // A task waiting for a command listens for nothing, but hangups
+            // are reported anyway. There's nobody left to answer, get_requester
+            // drops the reply once the command is done
+            if (t->waiting && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                delete_task(t->fd);
+                continue;
+            }
+
+            if (t->write_blocked) {
+                uint64_t start = trace_begin();
+                flush_task(t);
+                trace_end("loop", "flush", start);
+                // Commands that were waiting for the client to catch up
+                if (!t->write_blocked && !t->delete && t->in_len > 0) run_client_input(t);
+                continue;
+            }
+
+            uint64_t start = trace_begin();
             int ret;
-            while ((ret = task_list[i].execute_task(task_list[i].fd)) == 0);
+            while ((ret = t->execute_task(t->fd)) == 0);
+            trace_end("loop", task_name(t->execute_task), start);
             if (ret == -1) {
                 success = false;
                 goto loop_end;
             }
         }
 
-        for (int i = task_list_len - 1; i >= 0; i--) {
-            if (!task_list[i].delete) continue;
-            close(task_list[i].fd);
-            memmove(&task_list[i], &task_list[i + 1], (task_list_len - i - 1) * sizeof(Task));
-            task_list_len--;
-        }
+        release_render();
+        update_suspend();
+        if (pending_changes) publish_status();
+        push_changes();
+        uint64_t start = trace_begin();
+        flush_scheduled_tasks();
+        trace_end("loop", "flush", start);
+        reap_tasks();
     }
     loop_end:
+    if (trace_file) finish_trace(NULL);
 
-    for (int i = 0; i < task_list_len; i++) close(task_list[i].fd);
-    task_list_len = 0;
+    free_task_table();
+    change_fd = -1;
+    suspend_fd = -1;
+    close(epoll_fd);
+    epoll_fd = -1;
+    close_status_page();
 
     return success;
 }
 
+// Called on the audio thread for every period the device wants
+void render_output(void* out, ma_uint32 frames) {
+    uint64_t span = trace_begin();
+    uint64_t now = now_ns();
+    uint64_t last = atomic_load_explicit(&output_last_ns, memory_order_relaxed);
+    uint64_t asked = atomic_load_explicit(&resume_asked_ns, memory_order_relaxed);
+    if (asked && atomic_compare_exchange_strong(&resume_asked_ns, &asked, 0)) {
+        // The time spent suspended isn't a gap
+        atomic_store_explicit(&resume_ns, now - asked, memory_order_relaxed);
+        if (now - asked > atomic_load_explicit(&resume_max_ns, memory_order_relaxed)) {
+            atomic_store_explicit(&resume_max_ns, now - asked, memory_order_relaxed);
+        }
+    } else if (last) {
+        uint64_t gap = now - last;
+        atomic_fetch_add_explicit(&output_gaps_ns, gap, memory_order_relaxed);
+        atomic_fetch_add_explicit(&output_gaps, 1, memory_order_relaxed);
+        if (gap > atomic_load_explicit(&output_max_gap_ns, memory_order_relaxed)) {
+            atomic_store_explicit(&output_max_gap_ns, gap, memory_order_relaxed);
+        }
+        // The device most likely played out all it had by then
+        if (gap > (uint64_t)frames * 2000000000 / ma_engine_get_sample_rate(&audio)) {
+            atomic_fetch_add_explicit(&late_callbacks, 1, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&output_last_ns, now, memory_order_relaxed);
+    atomic_fetch_add_explicit(&output_frames, frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&output_callbacks, 1, memory_order_relaxed);
+
+    if (deep_buffer) {
+        play_rendered(out, frames);
+    } else {
+        mix(out, frames);
+    }
+    trace_end("audio", "callback", span);
+}
+
+void on_output(ma_device* device, void* out, const void* in, ma_uint32 frames) {
+    (void) device;
+    (void) in;
+    render_output(out, frames);
+}
+
+// With --offline there's no device, offline_thread takes the place of its
+// callback and renders period after period as fast as it can. Stopping it
+// waits for the period it's in, just like stopping a device
+void* run_offline_thread(void* arg) {
+    (void) arg;
+    trace_thread_name = "offline";
+    float* buf = malloc(OFFLINE_PERIOD * OFFLINE_CHANNELS * sizeof(float));
+    pthread_mutex_lock(&offline_lock);
+    while (offline_running && buf) {
+        if (!atomic_load(&offline_playing)) {
+            pthread_cond_wait(&offline_wake, &offline_lock);
+            continue;
+        }
+        // Checks for a stop request once per period so stopping waits at most
+        // for the period in flight
+        offline_busy = true;
+        pthread_mutex_unlock(&offline_lock);
+        render_output(buf, OFFLINE_PERIOD);
+        pthread_mutex_lock(&offline_lock);
+        offline_busy = false;
+        pthread_cond_signal(&offline_idle);
+    }
+    pthread_mutex_unlock(&offline_lock);
+    free(buf);
+    return NULL;
+}
+
+void set_offline_playing(bool playing) {
+    pthread_mutex_lock(&offline_lock);
+    atomic_store(&offline_playing, playing);
+    pthread_cond_signal(&offline_wake);
+    while (!playing && offline_busy) pthread_cond_wait(&offline_idle, &offline_lock);
+    pthread_mutex_unlock(&offline_lock);
+}
+
+ma_result start_output(void) {
+    if (!offline) return ma_device_start(&output);
+    set_offline_playing(true);
+    return MA_SUCCESS;
+}
+
+ma_result stop_output(void) {
+    if (!offline) return ma_device_stop(&output);
+    set_offline_playing(false);
+    return MA_SUCCESS;
+}
+
+// No callback runs and none will until start_output
+bool output_stopped(void) {
+    if (offline) return !atomic_load(&offline_playing);
+    return ma_device_get_state(&output) == ma_device_state_stopped;
+}
+
+// Opens the device the engine plays to. Without a period size the backend
+// picks its own, usually tens of milliseconds
+bool init_output(void) {
+    if (offline) {
+        offline_running = true;
+        if (pthread_create(&offline_thread, NULL, run_offline_thread, NULL) == 0) return true;
+        offline_running = false;
+        return false;
+    }
+
+    ma_device_config config = ma_device_config_init(ma_device_type_playback);
+    config.playback.format = ma_format_f32;
+    config.dataCallback = on_output;
+    config.noPreSilencedOutputBuffer = MA_TRUE; // The engine writes every frame
+    config.noClip = MA_TRUE; // And clips them itself
+    if (output_period) {
+        config.periodSizeInFrames = output_period;
+        config.performanceProfile = ma_performance_profile_low_latency;
+    }
+    // Plays in real time, but to nowhere
+    ma_backend null_backend = ma_backend_null;
+    return ma_device_init_ex(null_output ? &null_backend : NULL, null_output ? 1 : 0, NULL, &config, &output) == MA_SUCCESS;
+}
+
+void uninit_output(void) {
+    if (!offline) {
+        ma_device_uninit(&output);
+        return;
+    }
+    if (!offline_running) return;
+    pthread_mutex_lock(&offline_lock);
+    offline_running = false;
+    pthread_cond_signal(&offline_wake);
+    pthread_mutex_unlock(&offline_lock);
+    pthread_join(offline_thread, NULL);
+}
+
+ma_resource_manager_config resources_config(ma_uint32 sample_rate, ma_uint32 threads) {
+    ma_resource_manager_config config = ma_resource_manager_config_init();
+    config.decodedFormat = ma_format_f32;
+    config.decodedChannels = 0;
+    config.decodedSampleRate = sample_rate;
+    config.jobThreadCount = threads;
+    config.pVFS = file_vfs.cb.onOpen ? &file_vfs : NULL;
+    return config;
+}
+
+// Streams BENCH_STREAMS copies of the file at once, reading them in
+// BENCH_PERIOD_MS periods BENCH_SPEED times faster than they play. A period
+// that can't be filled because the job threads haven't decoded it yet is
+// an underrun, as the device would have played silence there
+int run_benchmark(const char* path) {
+    ma_uint32 thread_counts[] = { 1, 2, 4, 8, job_threads };
+    size_t settings = ARRLEN(thread_counts);
+    for (size_t i = 0; i + 1 < ARRLEN(thread_counts); i++) {
+        if (thread_counts[i] == job_threads) settings--;
+    }
+    ma_uint32 period = BENCH_SAMPLE_RATE * BENCH_PERIOD_MS / 1000;
+    float* buf = malloc(period * 8 * sizeof(float)); // Room for 7.1
+    if (!buf) return 1;
+
+    printf("Benchmark of %s: %d streams, %d ms periods at %dx speed, %d ms pages\n", path, BENCH_STREAMS,
+        BENCH_PERIOD_MS, BENCH_SPEED, MA_RESOURCE_MANAGER_PAGE_SIZE_IN_MILLISECONDS);
+
+    for (size_t i = 0; i < settings; i++) {
+        ma_uint32 threads = thread_counts[i];
+
+        ma_resource_manager_config config = resources_config(BENCH_SAMPLE_RATE, threads);
+        ma_resource_manager resources;
+        if (ma_resource_manager_init(&config, &resources) != MA_SUCCESS) {
+            printf("Cannot start %u job threads\n", threads);
+            free(buf);
+            return 1;
+        }
+
+        ma_resource_manager_data_source streams[BENCH_STREAMS];
+        int opened = 0;
+        for (; opened < BENCH_STREAMS; opened++) {
+            ma_uint32 flags = MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_STREAM | MA_RESOURCE_MANAGER_DATA_SOURCE_FLAG_ASYNC;
+            if (ma_resource_manager_data_source_init(&resources, path, flags, NULL, &streams[opened]) != MA_SUCCESS) break;
+        }
+
+        // Reads fail until a stream is opened, which isn't what's measured
+        for (int s = 0; s < opened; s++) {
+            while (ma_resource_manager_data_source_result(&streams[s]) == MA_BUSY) usleep(1000);
+        }
+
+        uint64_t start = now_ns();
+        uint64_t periods = 0, underruns = 0;
+        bool playing = opened == BENCH_STREAMS;
+        while (playing) {
+            playing = false;
+            for (int s = 0; s < opened; s++) {
+                ma_uint64 read = 0;
+                ma_result result = ma_data_source_read_pcm_frames(&streams[s], buf, period, &read);
+                if (result == MA_AT_END) continue;
+                if (result != MA_SUCCESS && result != MA_BUSY) continue;
+                if (read < period) underruns++;
+                playing = true;
+            }
+            periods++;
+            usleep(BENCH_PERIOD_MS * 1000 / BENCH_SPEED);
+        }
+        double seconds = (now_ns() - start) / 1e9;
+
+        for (int s = 0; s < opened; s++) ma_resource_manager_data_source_uninit(&streams[s]);
+        ma_resource_manager_uninit(&resources);
+        if (opened < BENCH_STREAMS) {
+            printf("cant load file %s\n" SUB("Can't even load files in this country"), path);
+            free(buf);
+            return 1;
+        }
+        printf("%2u job threads: %llu underruns in %llu periods, %.3f s\n", threads,
+            (unsigned long long)underruns, (unsigned long long)periods, seconds);
+    }
+    free(buf);
+    return 0;
+}
+
+void print_usage(const char* name) {
+    printf(
+        "Usage: %s [options] [music_file...]\n"
+        "Options:\n"
+        "    -o, --output-limit <bytes> -- Evict clients with more unread output than this (default: %d)\n"
+        "    -x, --crossfade <seconds>  -- Fade between tracks (default: 0, gapless)\n"
+        "    -c, --cache-size <MiB>     -- Memory for decoded replays and loops, 0 to disable (default: %d)\n"
+        "    -r, --readahead <MiB>      -- Read files in blocks this large on a separate thread (default: 0, map them)\n"
+        "    -j, --job-threads <count>  -- Threads loading and decoding files (default: %d)\n"
+        "    -l, --latency <frames>     -- Play in periods this short, with the low latency profile (default: 0, backend's choice)\n"
+        "    -d, --deep-buffer <ms>     -- Render this much audio ahead on a separate thread, to save power (default: 0, off)\n"
+        "    -S, --suspend-after <secs> -- Stop the audio device after this long without playing, 0 never (default: %.0f)\n"
+        "    -n, --null-output          -- Play in real time to no sound card\n"
+        "    -O, --offline              -- Play as fast as possible to no sound card\n"
+        "    -s, --sync-load            -- Load files before answering, blocking everything else meanwhile\n"
+        "    -m, --metrics              -- Serve Prometheus metrics on putin-metrics.sock next to putin.sock\n"
+        "    -b, --benchmark <file>     -- Stream the file with different thread counts, report underruns and exit\n"
+        "    -C, --config <file>        -- Read options from a file, one `name value` per line\n"
+        "    -h, --help                 -- Show this help\n"
+        "Decoded streams are paged in %d ms pages, see PAGE_MS in the Makefile\n",
+        name, OUT_HIGH_WATER_DEFAULT, CACHE_BUDGET_DEFAULT / (1024 * 1024), JOB_THREADS_DEFAULT, SUSPEND_AFTER_DEFAULT,
+        MA_RESOURCE_MANAGER_PAGE_SIZE_IN_MILLISECONDS);
+}
+
+const struct option options[] = {
+    { "output-limit",  required_argument, NULL, 'o' },
+    { "crossfade",     required_argument, NULL, 'x' },
+    { "cache-size",    required_argument, NULL, 'c' },
+    { "readahead",     required_argument, NULL, 'r' },
+    { "job-threads",   required_argument, NULL, 'j' },
+    { "latency",       required_argument, NULL, 'l' },
+    { "deep-buffer",   required_argument, NULL, 'd' },
+    { "suspend-after", required_argument, NULL, 'S' },
+    { "null-output",   no_argument,       NULL, 'n' },
+    { "offline",       no_argument,       NULL, 'O' },
+    { "sync-load",     no_argument,       NULL, 's' },
+    { "metrics",       no_argument,       NULL, 'm' },
+    { "benchmark",     required_argument, NULL, 'b' },
+    { "config",        required_argument, NULL, 'C' },
+    { "help",          no_argument,       NULL, 'h' },
+    { 0 },
+};
+
+bool read_config(const char* path);
+
+bool set_option(int opt, char* arg) {
+    switch (opt) {
+    case 'o': {
+        char* end;
+        unsigned long long limit = strtoull(arg, &end, 10);
+        if (*end != '\0' || limit < OUT_CHUNK_LEN) {
+            printf("Output limit must be a number of bytes, at least %d\n", OUT_CHUNK_LEN);
+            return false;
+        }
+        out_high_water = limit;
+        return true;
+    }
+    case 'x': {
+        char* end;
+        float c = strtof(arg, &end);
+        if (*end != '\0' || c < 0.0f || c > CROSSFADE_MAX) {
+            printf("Crossfade must be a number of seconds, at most %.0f\n", CROSSFADE_MAX);
+            return false;
+        }
+        crossfade = c;
+        return true;
+    }
+    case 'c': {
+        char* end;
+        unsigned long long size = strtoull(arg, &end, 10);
+        if (*end != '\0' || size > SIZE_MAX / (1024 * 1024)) {
+            printf("Cache size must be a number of MiB\n");
+            return false;
+        }
+        cache_budget = size * 1024 * 1024;
+        return true;
+    }
+    case 'r': {
+        char* end;
+        unsigned long size = strtoul(arg, &end, 10);
+        if (*end != '\0' || size > READAHEAD_MAX) {
+            printf("Readahead must be a number of MiB, at most %d\n", READAHEAD_MAX);
+            return false;
+        }
+        readahead_block = size * 1024 * 1024;
+        return true;
+    }
+    case 'j': {
+        char* end;
+        unsigned long count = strtoul(arg, &end, 10);
+        if (*end != '\0' || count < 1 || count > MA_RESOURCE_MANAGER_MAX_JOB_THREAD_COUNT) {
+            printf("Job threads must be a number from 1 to %d\n", MA_RESOURCE_MANAGER_MAX_JOB_THREAD_COUNT);
+            return false;
+        }
+        job_threads = count;
+        return true;
+    }
+    case 'l': {
+        char* end;
+        unsigned long period = strtoul(arg, &end, 10);
+        if (*end != '\0' || (period && (period < PERIOD_MIN || period > PERIOD_MAX))) {
+            printf("Latency must be a number of frames from %d to %d, or 0\n", PERIOD_MIN, PERIOD_MAX);
+            return false;
+        }
+        output_period = period;
+        return true;
+    }
+    case 'd': {
+        char* end;
+        unsigned long ms = strtoul(arg, &end, 10);
+        if (*end != '\0' || ms > DEEP_BUFFER_MAX) {
+            printf("Deep buffer must be a number of ms, at most %d\n", DEEP_BUFFER_MAX);
+            return false;
+        }
+        deep_buffer = ms;
+        return true;
+    }
+    case 'S': {
+        char* end;
+        float seconds = strtof(arg, &end);
+        if (*end != '\0' || seconds < 0.0f || seconds > SUSPEND_AFTER_MAX) {
+            printf("Suspend time must be a number of seconds, at most %.0f\n", SUSPEND_AFTER_MAX);
+            return false;
+        }
+        suspend_after = seconds;
+        return true;
+    }
+    case 'n':
+        null_output = true;
+        return true;
+    case 'O':
+        offline = true;
+        return true;
+    case 's':
+        sync_load = true;
+        return true;
+    case 'm':
+        metrics = true;
+        return true;
+    case 'b':
+        strncpy(benchmark_path, arg, PATH_LEN - 1);
+        return true;
+    case 'C':
+        return read_config(arg);
+    default:
+        return false;
+    }
+}
+
+// Lines are long option names followed by their value, # starts a comment
+bool read_config(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Cannot open config %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[PATH_LEN + 64];
+    int line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_num++;
+        // Drops the comment and the spaces before it, and \r from CRLF files
+        size_t len = strcspn(line, "#\n");
+        while (len > 0 && strchr(" \t\r", line[len - 1])) len--;
+        line[len] = '\0';
+        char* name = line + strspn(line, " \t");
+        if (*name == '\0') continue;
+        char* value = cut_and_get_next_word(name);
+
+        const struct option* o = options;
+        while (o->name && strcmp(o->name, name)) o++;
+        if (!o->name || o->val == 'h' || o->val == 'C') {
+            printf("%s:%d: unknown option %s\n", path, line_num, name);
+            ok = false;
+        } else if ((o->has_arg == required_argument) != (*value != '\0')) {
+            printf("%s:%d: %s %s\n", path, line_num, name, *value ? "takes no value" : "needs a value");
+            ok = false;
+        } else {
+            ok = set_option(o->val, value);
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+bool parse_args(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:x:c:r:j:l:d:S:nOsmb:C:h", options, NULL)) != -1) {
+        if (opt == 'h') {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (!set_option(opt, optarg)) {
+            if (opt == '?') print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
-    if (ma_engine_init(NULL, &audio)) {
+    if (!parse_args(argc, argv)) return 1;
+    build_command_table();
+
+    // Clients hanging up are handled where writes fail
+    signal(SIGPIPE, SIG_IGN);
+
+    // Without it files are simply read through stdio
+    if (!init_file_vfs()) file_vfs.cb.onOpen = NULL;
+    if (*benchmark_path) return run_benchmark(benchmark_path);
+
+    if (!init_output()) {
+        printf("failed to open audio device.\n" SUB("I think your audio is dead"));
+        return 1;
+    }
+
+    // Decodes at the device's sample rate, so the engine never resamples
+    ma_uint32 sample_rate = offline ? OFFLINE_SAMPLE_RATE : output.sampleRate;
+    ma_resource_manager_config resources_conf = resources_config(sample_rate, job_threads);
+    if (ma_resource_manager_init(&resources_conf, &resources) != MA_SUCCESS) {
+        printf("failed to start %u job threads.\n", job_threads);
+        uninit_output();
+        return 1;
+    }
+
+    ma_engine_config engine_config = ma_engine_config_init();
+    engine_config.pResourceManager = &resources;
+    engine_config.noAutoStart = MA_TRUE;
+    if (offline) {
+        engine_config.noDevice = MA_TRUE;
+        engine_config.channels = OFFLINE_CHANNELS;
+        engine_config.sampleRate = OFFLINE_SAMPLE_RATE;
+    } else {
+        engine_config.pDevice = &output;
+    }
+
+    if (ma_engine_init(&engine_config, &audio)) {
         printf("failed to initialize audio engine.\n" SUB("I think your audio is dead"));
+        ma_resource_manager_uninit(&resources);
+        uninit_output();
         return 1;
     }
+    // Offline rendering is paced by nothing but the CPU already
+    if (offline) deep_buffer = 0;
+    if (deep_buffer && !start_render_thread()) {
+        printf("Cannot start render thread, rendering in the audio callback\n");
+        deep_buffer = 0;
+    }
+    if (!offline) start_output();
+    wake_render();
 
-    if (argc > 1) {
-        if (ma_sound_init_from_file(&audio, argv[1], MA_SOUND_FLAG_STREAM, NULL, NULL, &sound)) {
-            printf("cant load file %s\n" SUB("Can't even load files in this country"), argv[1]);
-        } else {
-            ma_sound_start(&sound);
-            strncpy(running_filepath, basename(argv[1]), PATH_LEN - 1);
-            printf("Playing %s\n", running_filepath);
-        }
+    if (ma_sound_group_init(&audio, 0, NULL, &voice_group) != MA_SUCCESS) {
+        printf("failed to initialize sound group.\n");
+        stop_render_thread();
+        stop_output();
+        ma_engine_uninit(&audio);
+        ma_resource_manager_uninit(&resources);
+        uninit_output();
+        if (deep_buffer) ma_pcm_rb_uninit(&render_rb);
+        return 1;
     }
+
+    // The first file plays, the rest are queued after it
+    for (int i = optind; i < argc; i++) insert_entry(queue_len, argv[i]);
+    start_from(0);
     
     int return_code = run_server() ? 0 : 1;
 
-    ma_sound_uninit(&sound);
+    stop_render_thread();
+    free_tracks();
+    free_cache();
+    ma_sound_group_uninit(&voice_group);
+    stop_output();
     ma_engine_uninit(&audio);
+    uninit_output();
+    if (deep_buffer) ma_pcm_rb_uninit(&render_rb);
+    ma_resource_manager_uninit(&resources);
+    stop_io_thread();
     return return_code;
 }